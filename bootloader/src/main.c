@@ -8,7 +8,6 @@
 #include "system_stm32l0xx.h"
 
 #include "usb.h"
-#include "osc.h"
 #include "usb_hid.h"
 #include "bootloader.h"
 #include "power.h"
@@ -28,8 +27,7 @@ int main(void)
 
     usb_init();
 
-    osc_request_hsi16();
-    usb_enable();
+    usb_enable(); //acquires the HSI16
 
     bootloader_run();
 
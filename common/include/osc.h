@@ -10,21 +10,112 @@
 #include <stdint.h>
 
 #define OSC_MAX_CALLBACKS 16
+#define OSC_MAX_REQUIREMENTS 8
+
+#define OSC_HSI16_FREQUENCY 16000000UL
+
+#define OSC_MSI_MAX_RANGE 6
+
+/**
+ * Highest MSI range (131KHz) which is run in low power run mode
+ */
+#define OSC_LPRUN_MAX_RANGE 1
+
+/**
+ * Frequency of an MSI range in Hz (range 0 is 65.536KHz, each range doubles)
+ */
+#define OSC_MSI_FREQUENCY(range) (65536UL << (range))
 
 typedef void (*OscChangeCallback)(void);
 
 /**
- * Requests the primary oscillator to change to the HSI16
+ * Handle to a clock requirement, see osc_add_requirement
+ */
+typedef uint8_t OscRequirement;
+
+/**
+ * Handle returned when no more requirements can be added. Using it does
+ * nothing.
+ */
+#define OSC_REQUIREMENT_NONE 0xFF
+
+/**
+ * Requests the primary oscillator to change to the HSI16. Applications
+ * using the clock governor should not call this directly.
  */
 void osc_request_hsi16(void);
 
 /**
- * Requests the primary oscillator to change to the MSI
- * 
+ * Requests the primary oscillator to change to the MSI. Applications using
+ * the clock governor should not call this directly.
+ *
  * range: Value 0-6 denoting the desired MSI frequency range
  */
 void osc_request_msi(uint8_t range);
 
+/**
+ * Clock governor
+ *
+ * Rather than selecting an oscillator themselves, modules declare the
+ * lowest system clock they can work with and acquire that requirement
+ * while they are active. The governor runs the system from the slowest
+ * clock satisfying every acquired requirement: the lowest sufficient MSI
+ * range, or the HSI16 if the MSI cannot reach the frequency. Requirements
+ * are reference counted and the clock only changes (running the change
+ * callbacks once) when the selection changes.
+ *
+ * When the selection is an MSI range up to OSC_LPRUN_MAX_RANGE, the core
+ * runs in low power run mode and sleeps in low power sleep mode, with the
+ * core voltage in range 2 as low power run requires. The other MSI ranges
+ * run in range 3.
+ *
+ * The governor must only be used from thread mode, since switching clocks
+ * runs every change callback.
+ */
+
+/**
+ * Declares a clock requirement, initially not acquired
+ *
+ * min_hz: Lowest system clock frequency the requirement is satisfied by
+ *
+ * Returns a handle to the requirement, or OSC_REQUIREMENT_NONE if there are
+ * already OSC_MAX_REQUIREMENTS
+ */
+OscRequirement osc_add_requirement(uint32_t min_hz);
+
+/**
+ * Changes the frequency of a requirement, switching clocks if it is acquired
+ * and this changes the selection
+ *
+ * req: Requirement to change
+ * min_hz: Lowest system clock frequency the requirement is satisfied by
+ */
+void osc_set_requirement(OscRequirement req, uint32_t min_hz);
+
+/**
+ * Acquires a requirement, switching clocks if this changes the selection
+ *
+ * req: Requirement to acquire
+ */
+void osc_acquire(OscRequirement req);
+
+/**
+ * Releases a requirement, switching clocks if this changes the selection.
+ * Releasing a requirement which is not acquired does nothing.
+ *
+ * req: Requirement to release
+ */
+void osc_release(OscRequirement req);
+
+/**
+ * Gets the time in microseconds the last governor clock switch took,
+ * including the change callbacks. This is measured with SysTick and stays 0
+ * unless SysTick is running as a free running cycle counter. Each side of
+ * the switch wraps after 2^24 cycles, about a second at the HSI16, far
+ * longer than a switch takes.
+ */
+uint32_t osc_get_switch_time(void);
+
 /**
  * Adds a callback function to the list called when the oscillator
  * frequency is changed
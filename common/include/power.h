@@ -8,14 +8,15 @@
 #define _POWER_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 
 /**
  * Power management
  *
  * The LED Wristwatch has the ability to tell when USB is plugged in and
- * the general battery charge status. It does not have the ability to
- * gauge the battery discharge state or the power load (maybe a future
- * version).
+ * the general battery charge status. It has no battery sense divider, but
+ * VDD comes from a buck regulator which stops regulating as the battery
+ * drains, so measuring VDD against VREFINT shows a nearly empty battery.
  *
  * This module controls the power status of the STM32, including
  * entering/exiting sleep mode, determining if USB is present, and
@@ -24,6 +25,23 @@
  * device stay awake longer.
  */
 
+/**
+ * Rate of the awake tick, which is clocked independently of the core clock
+ */
+#define POWER_TICK_HZ 64
+
+/**
+ * States whose residency is counted
+ */
+typedef enum {
+    POWER_RES_RUN_MSI, //running from the MSI
+    POWER_RES_RUN_HSI16, //running from the HSI16
+    POWER_RES_RUN_LPRUN, //running in low power run
+    POWER_RES_SLEEP, //waiting for an event while awake (Sleep or LP sleep)
+    POWER_RES_STOP, //asleep in Stop mode
+    POWER_RES_COUNT
+} PowerResidency;
+
 typedef enum { POWER_BATTERY_DISCHARGING, POWER_BATTERY_CHARGING, POWER_BATTERY_CHARGED } PowerBatteryState;
 
 /**
@@ -32,7 +50,8 @@ typedef enum { POWER_BATTERY_DISCHARGING, POWER_BATTERY_CHARGING, POWER_BATTERY_
 void power_init(void);
 
 /**
- * Main method for power management, never exits.
+ * Main method for power management, never exits. The core sleeps between
+ * awake ticks and USB presence changes.
  */
 void power_main(void);
 
@@ -41,19 +60,106 @@ void power_main(void);
  */
 PowerBatteryState power_get_battery_state(void);
 
+/**
+ * Returns the filtered supply voltage in millivolts. This is sampled with the
+ * ADC against VREFINT once at startup and then every time the device goes to
+ * sleep, right before entering Stop, so the wake path doesn't wait for the
+ * ADC. A wake therefore sees the voltage from the end of the previous awake
+ * period. It reads the regulated VDD until the battery drops close to it,
+ * after which it follows the battery.
+ */
+uint16_t power_get_battery_voltage(void);
+
 /**
  * Sets the time that the device should remain awake. This must be called
  * before a waking interrupt exits in order to prevent the device from
  * going back to sleep.
  *
- * ticks: Number of ticks to stay awake (TODO: Determine what a tick is)
+ * This may be called from interrupts.
+ *
+ * ms: Milliseconds to stay awake, rounded up to whole awake ticks
+ */
+void power_set_awake_time(uint32_t ms);
+
+/**
+ * Returns the milliseconds remaining before the device goes to sleep, or 0
+ * if it is about to
+ */
+uint32_t power_get_awake_time(void);
+
+/**
+ * Returns the number of awake ticks since reset. This does not advance while
+ * the device is asleep.
+ */
+uint32_t power_get_ticks(void);
+
+/**
+ * Runs hook_power_awake as soon as possible, outside of the awake tick, if
+ * the device is awake. This may be called from interrupts.
+ */
+void power_request_update(void);
+
+/**
+ * Declares whether the application has anything to compute on the coming
+ * awake ticks. While busy, the power module holds a clock requirement for
+ * running hook_power_awake quickly. While idle it is released, so the clock
+ * governor can drop to the slowest clock the other modules need, which is
+ * low power run and low power sleep if slow enough. The application is
+ * busy after waking.
+ *
+ * Switching costs a clock change (see osc_get_switch_time), so this should
+ * only be set idle for spans of several awake ticks.
+ *
+ * idle: True if the application is idle
+ */
+void power_set_idle(bool idle);
+
+/**
+ * Returns the total time spent in a state since reset in milliseconds. Time
+ * is measured with LPTIM1, which keeps running from the LSE (or LSI) in
+ * every state. The time counted before LPTIM1 changes source is scaled to
+ * the new one.
+ *
+ * state: State to get the residency of
+ */
+uint64_t power_get_residency(PowerResidency state);
+
+/**
+ * Returns the milliseconds since the awake tick first started, including
+ * the time spent asleep. This wraps after about 49 days, so only the
+ * difference between two calls is meaningful.
+ */
+uint32_t power_get_uptime(void);
+
+/**
+ * Restarts the awake tick, selecting the LPTIM1 clock again. This must be
+ * called right after anything stops the LSE while the tick may be running
+ * from it, such as a backup domain reset, or the tick stops until the LSE
+ * is back. The tick moves to the LSI until the next wake after the LSE is
+ * ready again.
+ */
+void power_restart_tick(void);
+
+/**
+ * Returns the time since the core last woke from Stop mode (or the power
+ * loop started) in microseconds, for measuring wake latency. The resolution
+ * is one LPTIM1 clock (about 31us) and the hardware Stop wakeup time before
+ * the core runs again is not included.
+ */
+uint32_t power_get_time_since_wake(void);
+
+/**
+ * Returns the number of pins which were not in a defined low power state
+ * when the device last entered Stop mode. This is 0 unless the sleep pin
+ * table is missing a pin or something overrides it.
  */
-void power_set_awake_time(uint32_t ticks);
+uint8_t power_get_sleep_violations(void);
 
 /**
- * Hook function implemented by the application which is called
- * repeatedly while the device is awake. The application should exit
- * this function as quickly as possible.
+ * Hook function implemented by the application which is called every
+ * awake tick (POWER_TICK_HZ) while the device is awake, and when an update
+ * is requested with power_request_update. The application should exit this
+ * function as quickly as possible.
  */
 void hook_power_awake(void);
 
@@ -1,5 +1,5 @@
 /**
- * LED Wristwatch Bootloader
+ * LED Wristwatch
  *
  * Kevin Cuzner
  */
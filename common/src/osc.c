@@ -7,18 +7,153 @@
 #include "osc.h"
 #include "stm32l0xx.h"
 
-static OscChangeCallback change_callbacks[16];
+#include <stdbool.h>
+
+//Selection value for the HSI16, above every MSI range
+#define OSC_SELECT_HSI16 (OSC_MSI_MAX_RANGE + 1)
+
+//Core voltage ranges as PWR_CR VOS values. Higher voltages have lower values.
+#define OSC_VOS_RANGE1 PWR_CR_VOS_0 //1.8V, up to 32MHz
+#define OSC_VOS_RANGE2 PWR_CR_VOS_1 //1.5V, up to 16MHz
+#define OSC_VOS_RANGE3 (PWR_CR_VOS_0 | PWR_CR_VOS_1) //1.2V, up to 4.2MHz
+
+//Fastest clocks which need no flash wait state, by range
+#define OSC_RANGE1_0WS_HZ 16000000UL
+#define OSC_RANGE2_0WS_HZ 8000000UL
+#define OSC_RANGE3_0WS_HZ 4200000UL
+
+#define SYSTICK_MAX 0xFFFFFF
+
+typedef struct {
+    uint32_t min_hz;
+    uint8_t refs;
+} OscRequirementEntry;
+
+static OscChangeCallback change_callbacks[OSC_MAX_CALLBACKS];
 static uint8_t next_change_callback = 0;
 
+static OscRequirementEntry requirements[OSC_MAX_REQUIREMENTS];
+static uint8_t next_requirement = 0;
+
+static uint32_t callbacks_start;
+
+//The last switch in SysTick cycles of the old clock up to the switch and of
+//the new clock for the callbacks. They are only converted to time when read,
+//since the divisions would add to every switch.
+static uint32_t switch_cycles_before, switch_hz_before;
+static uint32_t switch_cycles_after, switch_hz_after;
+
 static void osc_run_callbacks(void)
 {
+    //marks where the new clock took over, for measuring switches
+    callbacks_start = SysTick->VAL;
     SystemCoreClockUpdate();
     for (uint8_t i = 0; i < next_change_callback; i++)
         change_callbacks[i]();
 }
 
+/**
+ * Changes the core voltage range, waiting for the regulator to settle
+ */
+static void osc_set_voltage(uint32_t vos)
+{
+    RCC->APB1ENR |= RCC_APB1ENR_PWREN;
+    while (PWR->CSR & PWR_CSR_VOSF) { }
+    PWR->CR = (PWR->CR & ~PWR_CR_VOS) | vos;
+    while (PWR->CSR & PWR_CSR_VOSF) { }
+}
+
+/**
+ * Returns whether the flash needs a wait state at a clock and voltage range
+ */
+static bool osc_needs_wait_state(uint32_t hz, uint32_t vos)
+{
+    switch (vos)
+    {
+    case OSC_VOS_RANGE1:
+        return hz > OSC_RANGE1_0WS_HZ;
+    case OSC_VOS_RANGE2:
+        return hz > OSC_RANGE2_0WS_HZ;
+    default:
+        return hz > OSC_RANGE3_0WS_HZ;
+    }
+}
+
+/**
+ * Sets the flash wait state. Prefetch only helps with a wait state, so it is
+ * enabled along with it. The flash is always powered down during Sleep.
+ */
+static void osc_set_wait_state(bool wait)
+{
+    uint32_t acr = FLASH->ACR & ~(FLASH_ACR_LATENCY | FLASH_ACR_PRFTEN);
+    if (wait)
+        acr |= FLASH_ACR_LATENCY | FLASH_ACR_PRFTEN;
+    FLASH->ACR = acr | FLASH_ACR_SLEEP_PD;
+    while ((FLASH->ACR & FLASH_ACR_LATENCY) != (acr & FLASH_ACR_LATENCY)) { }
+}
+
+/**
+ * Raises the core voltage and adds a flash wait state, if needed, before
+ * switching to a clock
+ *
+ * hz: System clock frequency about to be selected
+ * vos: Voltage range for the new clock
+ */
+static void osc_scale_before(uint32_t hz, uint32_t vos)
+{
+    if (vos < (PWR->CR & PWR_CR_VOS))
+        osc_set_voltage(vos);
+    if (osc_needs_wait_state(hz, vos))
+        osc_set_wait_state(true);
+}
+
+/**
+ * Removes an unneeded flash wait state and lowers the core voltage, if
+ * possible, after switching to a clock
+ *
+ * hz: System clock frequency just selected
+ * vos: Voltage range for the new clock
+ */
+static void osc_scale_after(uint32_t hz, uint32_t vos)
+{
+    if (!osc_needs_wait_state(hz, vos))
+        osc_set_wait_state(false);
+    if (vos > (PWR->CR & PWR_CR_VOS))
+        osc_set_voltage(vos);
+}
+
+/**
+ * Enters low power run, with the regulator in low power mode. The system
+ * clock must be at most OSC_MSI_FREQUENCY(OSC_LPRUN_MAX_RANGE).
+ */
+static void osc_enter_low_power_run(void)
+{
+    RCC->APB1ENR |= RCC_APB1ENR_PWREN;
+    PWR->CR |= PWR_CR_LPSDSR;
+    PWR->CR |= PWR_CR_LPRUN;
+}
+
+/**
+ * Returns to the main regulator, if in low power run
+ */
+static void osc_exit_low_power_run(void)
+{
+    if (!(PWR->CR & PWR_CR_LPRUN))
+        return;
+
+    PWR->CR &= ~PWR_CR_LPRUN;
+    while (PWR->CSR & PWR_CSR_REGLPF) { }
+    PWR->CR &= ~PWR_CR_LPSDSR;
+}
+
 void osc_request_hsi16(void)
 {
+    osc_exit_low_power_run();
+
+    //Range 2 would be enough for 16MHz, but USB (the reason for running
+    //this fast) is only run in range 1
+    osc_scale_before(OSC_HSI16_FREQUENCY, OSC_VOS_RANGE1);
+
     //turn on HSI16 and switch the processor clock
     RCC->CR |= RCC_CR_HSION;
     while (!(RCC->CR & RCC_CR_HSIRDY)) { }
@@ -29,14 +164,25 @@ void osc_request_hsi16(void)
     //turn off MSI
     RCC->CR &= ~RCC_CR_MSION;
 
+    osc_scale_after(OSC_HSI16_FREQUENCY, OSC_VOS_RANGE1);
+
     osc_run_callbacks();
 }
 
 void osc_request_msi(uint8_t range)
 {
+    uint32_t vos;
+
     range &= 0x7;
-    if (range > 6)
-        range = 6;
+    if (range > OSC_MSI_MAX_RANGE)
+        range = OSC_MSI_MAX_RANGE;
+
+    osc_exit_low_power_run();
+
+    //Every MSI range runs in range 3, except that low power run may only be
+    //entered from range 2
+    vos = range <= OSC_LPRUN_MAX_RANGE ? OSC_VOS_RANGE2 : OSC_VOS_RANGE3;
+    osc_scale_before(OSC_MSI_FREQUENCY(range), vos);
 
     //Change the MSI range to the requested range
     uint32_t temp = RCC->ICSCR;
@@ -54,6 +200,13 @@ void osc_request_msi(uint8_t range)
     //turn off HSI
     RCC->CR &= ~RCC_CR_HSION;
 
+    osc_scale_after(OSC_MSI_FREQUENCY(range), vos);
+
+    //The slowest ranges can run from the low power regulator, which also
+    //makes every WFI enter low power sleep
+    if (range <= OSC_LPRUN_MAX_RANGE)
+        osc_enter_low_power_run();
+
     osc_run_callbacks();
 }
 
@@ -62,3 +215,102 @@ void osc_add_callback(OscChangeCallback fn)
     change_callbacks[next_change_callback++] = fn;
 }
 
+
+/**
+ * Returns the oscillator selection currently driving the system clock
+ */
+static uint8_t osc_get_selection(void)
+{
+    if ((RCC->CFGR & RCC_CFGR_SWS) == RCC_CFGR_SWS_HSI)
+        return OSC_SELECT_HSI16;
+    return (RCC->ICSCR & RCC_ICSCR_MSIRANGE) >> RCC_ICSCR_MSIRANGE_Pos;
+}
+
+/**
+ * Selects the slowest clock satisfying the acquired requirements and
+ * switches to it if it isn't already running
+ */
+static void osc_govern(void)
+{
+    uint32_t min_hz = 0, from_hz, start;
+    uint8_t selection = 0;
+
+    for (uint8_t i = 0; i < next_requirement; i++)
+    {
+        if (requirements[i].refs && requirements[i].min_hz > min_hz)
+            min_hz = requirements[i].min_hz;
+    }
+    while (selection < OSC_SELECT_HSI16 && OSC_MSI_FREQUENCY(selection) < min_hz)
+        selection++;
+
+    if (selection == osc_get_selection())
+        return;
+
+    //SysTick counts cycles of the old clock up to the switch and of the new
+    //clock for the callbacks, if it is running
+    from_hz = SystemCoreClock;
+    start = SysTick->VAL;
+
+    if (selection == OSC_SELECT_HSI16)
+        osc_request_hsi16();
+    else
+        osc_request_msi(selection);
+
+    if (SysTick->CTRL & SysTick_CTRL_ENABLE_Msk)
+    {
+        uint32_t end = SysTick->VAL;
+        switch_cycles_before = (start - callbacks_start) & SYSTICK_MAX;
+        switch_hz_before = from_hz;
+        switch_cycles_after = (callbacks_start - end) & SYSTICK_MAX;
+        switch_hz_after = SystemCoreClock;
+    }
+}
+
+OscRequirement osc_add_requirement(uint32_t min_hz)
+{
+    if (next_requirement >= OSC_MAX_REQUIREMENTS)
+        return OSC_REQUIREMENT_NONE;
+
+    requirements[next_requirement].min_hz = min_hz;
+    requirements[next_requirement].refs = 0;
+    return next_requirement++;
+}
+
+void osc_set_requirement(OscRequirement req, uint32_t min_hz)
+{
+    if (req >= next_requirement || requirements[req].min_hz == min_hz)
+        return;
+
+    requirements[req].min_hz = min_hz;
+    if (requirements[req].refs)
+        osc_govern();
+}
+
+void osc_acquire(OscRequirement req)
+{
+    if (req >= next_requirement)
+        return;
+
+    if (!requirements[req].refs++)
+        osc_govern();
+}
+
+void osc_release(OscRequirement req)
+{
+    if (req >= next_requirement || !requirements[req].refs)
+        return;
+
+    if (!--requirements[req].refs)
+        osc_govern();
+}
+
+uint32_t osc_get_switch_time(void)
+{
+    if (!switch_hz_before)
+        return 0;
+
+    //up to 24 bits of cycles times a million needs 64 bits, which is fine
+    //for a diagnostic read rarely
+    return (uint64_t)switch_cycles_before * 1000000 / switch_hz_before +
+        (uint64_t)switch_cycles_after * 1000000 / switch_hz_after;
+}
@@ -9,10 +9,45 @@
 #include <stdbool.h>
 
 #include "stm32l0xx.h"
+#include "osc.h"
 
 #define USB_PRES_MASK GPIO_IDR_ID0
 #define BAT_CHG_MASK GPIO_IDR_ID1
 
+//The awake tick runs from LPTIM1 on the LSE (or LSI), not the core clock
+#define POWER_LSE_HZ 32768
+#define POWER_LSI_HZ 37000
+
+//While in Stop, LPTIM1 only counts the time asleep, at 1/128 of its clock
+#define POWER_STOP_PRESCALE_SHIFT 7
+
+//Factory VREFINT reading at VDD = 3.0V
+#define POWER_VREFINT_CAL (*(const uint16_t *)0x1FF80078)
+#define POWER_VREFINT_CAL_MV 3000
+
+//Clock held for the application while it is not idle
+#define POWER_RENDER_CLOCK_HZ OSC_MSI_FREQUENCY(5)
+
+//Reasons for the main loop to wake up, set by interrupts
+#define POWER_FLAG_TICK 0x1
+#define POWER_FLAG_INPUT 0x2
+#define POWER_FLAG_UPDATE 0x4
+
+//Awake ticks the inputs must settle for after an edge before being sampled
+#define POWER_DEBOUNCE_TICKS 2
+
+typedef enum { PWR_PIN_KEEP, PWR_PIN_ANALOG, PWR_PIN_LOW, PWR_PIN_HIGH } PowerPinState;
+typedef struct {
+    GPIO_TypeDef *port;
+    uint16_t pins;
+    PowerPinState state;
+} PowerSleepPin;
+typedef struct {
+    uint32_t moder;
+    uint32_t pupdr;
+    uint32_t odr;
+} PowerPortState;
+
 typedef enum { PWR_EVT_ANY, PWR_EVT_NONE, PWR_EVT_USB_CONNECT, PWR_EVT_USB_DISCONNECT } PowerEvent;
 typedef enum { PWR_ST_INIT, PWR_ST_USB, PWR_ST_BATTERY, PWR_ST_SLEEP } PowerState;
 typedef PowerState (*PowerStateFn)(void);
@@ -22,8 +57,61 @@ typedef struct {
     PowerStateFn fn;
 } PowerStateEntry;
 
-static uint32_t countdown;
 static uint32_t input_state;
+static volatile uint32_t debounce_deadline;
+static volatile bool debouncing;
+static volatile uint32_t ticks;
+static volatile uint32_t deadline;
+static volatile uint8_t events;
+static uint8_t flags;
+
+/**
+ * State of every GPIOA and GPIOB pin while in Stop mode. Each pin must be
+ * listed exactly once, which the firmware host tests check and
+ * power_audit_stop_state checks again at every sleep.
+ */
+static const PowerSleepPin sleep_pins[] = {
+    //LED lines: high, like PA5 (see leds_disable), so no LED is reverse biased
+    { GPIOA, 0x003F, PWR_PIN_HIGH },
+    //Buzzer off
+    { GPIOA, 0x0040, PWR_PIN_LOW },
+    //Unused, and USB (disabled while asleep)
+    { GPIOA, 0x9F80, PWR_PIN_ANALOG },
+    //SWD
+    { GPIOA, 0x6000, PWR_PIN_KEEP },
+    //~USB_PRES, CHG_STAT, ~ACCEL_INT: pulled up wake sources
+    { GPIOB, 0x0007, PWR_PIN_KEEP },
+    //Mux select low, mux enable high (disabled)
+    { GPIOB, 0x0078, PWR_PIN_LOW },
+    { GPIOB, 0x0080, PWR_PIN_HIGH },
+    //I2C, held high by the bus pullups
+    { GPIOB, 0x0300, PWR_PIN_KEEP },
+    //Buttons: pulled up wake sources
+    { GPIOB, 0x7800, PWR_PIN_KEEP },
+    //Unused
+    { GPIOB, 0x8400, PWR_PIN_ANALOG },
+};
+#define SLEEP_PIN_COUNT (sizeof(sleep_pins)/sizeof(*sleep_pins))
+
+static GPIO_TypeDef *const sleep_ports[] = { GPIOA, GPIOB };
+#define SLEEP_PORT_COUNT (sizeof(sleep_ports)/sizeof(*sleep_ports))
+
+static PowerPortState sleep_saved_ports[SLEEP_PORT_COUNT];
+static uint32_t sleep_saved_iopenr, sleep_saved_ahbenr, sleep_saved_apb1enr, sleep_saved_apb2enr;
+static uint8_t sleep_violations;
+static uint32_t sleep_saved_pwr_cr;
+
+static OscRequirement render_clock;
+static bool idle;
+
+//Residency is counted in LPTIM1 clocks
+static uint32_t lptim_hz;
+static uint32_t tick_period;
+static uint32_t last_stamp;
+static uint32_t wake_stamp;
+static uint64_t residency[POWER_RES_COUNT];
+
+static uint16_t battery_mv;
 
 void __attribute__((weak)) hook_power_awake(void) { }
 void __attribute__((weak)) hook_power_on_wake(void) { }
@@ -43,6 +131,9 @@ void power_init(void)
     //Enable pullups
     GPIOB->PUPDR &= ~(GPIO_PUPDR_PUPD0 | GPIO_PUPDR_PUPD1);
     GPIOB->PUPDR |= GPIO_PUPDR_PUPD0_0 | GPIO_PUPDR_PUPD1_0;
+
+    render_clock = osc_add_requirement(POWER_RENDER_CLOCK_HZ);
+    idle = true;
 }
 
 /**
@@ -51,14 +142,25 @@ void power_init(void)
  * 1. When the USB is plugged in:
  *  - The face is always on
  *  - The HSI16 and HSI48 are activated (HSI48 logic may be moved to usb_enable/disable)
- *  - hook_power_awake is run continuously
+ *  - hook_power_awake is run every awake tick
  * 2. When the USB is unplugged
  *  2a. When the watch is inactive (face off, possibly sleeping):
  *    - MSI is slowed as much as possible, or the device is put into Stop
  *  2b. When the watch is active (face on, awake):
  *    - MSI is increased to minimum speed for running watch face without flicker
- *    - hook_power_awake is run continuously
- *    - Remain in this mode until the active countdown reaches zero
+ *    - hook_power_awake is run every awake tick
+ *    - Remain in this mode until the awake deadline passes
+ *
+ * Between events (awake ticks, USB presence and charge status edges) the
+ * core waits in Sleep mode. Edges are debounced over a few awake ticks and
+ * only a settled change of USB presence is passed to the state machine.
+ * While the application declares itself idle (see power_set_idle), its
+ * clock requirement is dropped and the core runs and sleeps at the slowest
+ * clock the active modules allow, in low power run and low power sleep if
+ * that is slow enough.
+ *
+ * While asleep, the core is in Stop mode until an interrupt wakes it, with
+ * the pins in the states of the sleep pin table and peripheral clocks gated.
  *
  * Implementation outside this module:
  * - hook_power_awake: Contains main watch state machine
@@ -66,14 +168,361 @@ void power_init(void)
  * - hook_power_on_sleep: Disables watch face
  */
 
+/**
+ * Selects the LPTIM1 clock: the LSE if it is running, otherwise the LSI
+ */
+static void power_lptim_select_clock(void)
+{
+    RCC->APB1ENR |= RCC_APB1ENR_LPTIM1EN;
+    RCC->CCIPR &= ~RCC_CCIPR_LPTIM1SEL;
+    if (RCC->CSR & RCC_CSR_LSERDY)
+    {
+        RCC->CCIPR |= RCC_CCIPR_LPTIM1SEL_0 | RCC_CCIPR_LPTIM1SEL_1;
+        lptim_hz = POWER_LSE_HZ;
+    }
+    else
+    {
+        RCC->CSR |= RCC_CSR_LSION;
+        while (!(RCC->CSR & RCC_CSR_LSIRDY)) { }
+        RCC->CCIPR |= RCC_CCIPR_LPTIM1SEL_0;
+        lptim_hz = POWER_LSI_HZ;
+    }
+}
+
+/**
+ * Restarts LPTIM1 from zero with an autoreload interrupt
+ */
+static void power_lptim_start(uint32_t cfgr, uint32_t arr)
+{
+    //configuration and interrupt enables may only change while disabled
+    LPTIM1->CR = 0;
+    LPTIM1->CFGR = cfgr;
+    LPTIM1->IER = LPTIM_IER_ARRMIE;
+    LPTIM1->CR = LPTIM_CR_ENABLE;
+    LPTIM1->ICR = LPTIM_ICR_ARRMCF;
+    NVIC_ClearPendingIRQ(LPTIM1_IRQn);
+    LPTIM1->ARR = arr;
+    LPTIM1->CR |= LPTIM_CR_CNTSTRT;
+}
+
+/**
+ * Reads the LPTIM1 counter, which runs asynchronously to the core
+ */
+static uint32_t power_lptim_count(void)
+{
+    uint32_t a, b;
+    do
+    {
+        a = LPTIM1->CNT;
+        b = LPTIM1->CNT;
+    } while (a != b);
+    return a;
+}
+
+/**
+ * Returns the time in LPTIM1 clocks while the awake tick runs. Interrupts
+ * must be disabled.
+ */
+static uint32_t power_timestamp(void)
+{
+    uint32_t count = power_lptim_count();
+    uint32_t t = ticks;
+
+    //a reload since interrupts were disabled hasn't been counted yet
+    if ((LPTIM1->ISR & LPTIM_ISR_ARRM) && count < tick_period / 2)
+        t++;
+    return t * tick_period + count;
+}
+
+/**
+ * Charges the time since the last accounting to a residency state.
+ * Interrupts must be disabled.
+ */
+static void power_account(PowerResidency state)
+{
+    uint32_t now = power_timestamp();
+    residency[state] += now - last_stamp;
+    last_stamp = now;
+}
+
+/**
+ * Returns the residency state of running at the current clock
+ */
+static PowerResidency power_run_state(void)
+{
+    if (PWR->CR & PWR_CR_LPRUN)
+        return POWER_RES_RUN_LPRUN;
+    if ((RCC->CFGR & RCC_CFGR_SWS) == RCC_CFGR_SWS_HSI)
+        return POWER_RES_RUN_HSI16;
+    return POWER_RES_RUN_MSI;
+}
+
+/**
+ * Starts the awake tick
+ */
+static void power_tick_start(void)
+{
+    uint32_t previous_hz = lptim_hz;
+
+    power_lptim_select_clock();
+
+    //the residency so far was counted in clocks of the previous source
+    if (previous_hz && previous_hz != lptim_hz)
+    {
+        for (uint8_t i = 0; i < POWER_RES_COUNT; i++)
+            residency[i] = residency[i] * lptim_hz / previous_hz;
+    }
+
+    tick_period = lptim_hz / POWER_TICK_HZ;
+    power_lptim_start(0, tick_period - 1);
+    NVIC_EnableIRQ(LPTIM1_IRQn);
+
+    //the counter restarted from zero
+    last_stamp = ticks * tick_period;
+}
+
+/**
+ * Switches LPTIM1 from the awake tick to counting the time spent in Stop
+ * mode. It reloads rarely, so its interrupt seldom wakes the core.
+ */
+static void power_stop_timer_start(void)
+{
+    power_lptim_start(LPTIM_CFGR_PRESC, 0xFFFF);
+}
+
+/**
+ * Expands a pin mask into a mask of the matching 2-bit fields of MODER and
+ * PUPDR
+ */
+static uint32_t power_pin_fields(uint16_t pins)
+{
+    uint32_t fields = 0;
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        if (pins & (1 << i))
+            fields |= 0x3UL << (i * 2);
+    }
+    return fields;
+}
+
+/**
+ * Checks the GPIO state against the sleep pin table
+ *
+ * Returns the number of pins which are not listed exactly once, are not in
+ * their listed state, or are kept as floating inputs
+ */
+static uint8_t power_audit_stop_state(void)
+{
+    uint8_t violations = 0;
+
+    for (uint8_t p = 0; p < SLEEP_PORT_COUNT; p++)
+    {
+        GPIO_TypeDef *port = sleep_ports[p];
+        uint16_t listed = 0;
+
+        for (uint8_t i = 0; i < SLEEP_PIN_COUNT; i++)
+        {
+            const PowerSleepPin *entry = &sleep_pins[i];
+            if (entry->port != port)
+                continue;
+
+            for (uint8_t pin = 0; pin < 16; pin++)
+            {
+                uint32_t mode = (port->MODER >> (pin * 2)) & 0x3;
+                uint32_t pull = (port->PUPDR >> (pin * 2)) & 0x3;
+                bool high = port->ODR & (1 << pin);
+                bool ok;
+
+                if (!(entry->pins & (1 << pin)))
+                    continue;
+                if (listed & (1 << pin))
+                {
+                    violations++;
+                    continue;
+                }
+                listed |= 1 << pin;
+
+                switch (entry->state)
+                {
+                case PWR_PIN_ANALOG:
+                    ok = mode == 0x3 && !pull;
+                    break;
+                case PWR_PIN_LOW:
+                    ok = mode == 0x1 && !high;
+                    break;
+                case PWR_PIN_HIGH:
+                    ok = mode == 0x1 && high;
+                    break;
+                default:
+                    ok = mode || pull;
+                    break;
+                }
+                if (!ok)
+                    violations++;
+            }
+        }
+
+        for (uint8_t pin = 0; pin < 16; pin++)
+        {
+            if (!(listed & (1 << pin)))
+                violations++;
+        }
+    }
+
+    return violations;
+}
+
+/**
+ * Puts the pins into their sleep state, gates the peripheral clocks and
+ * selects the low power regulator for Stop mode. Interrupts must be disabled
+ * until power_exit_stop_state, since their handlers expect the normal state.
+ */
+static void power_enter_stop_state(void)
+{
+    for (uint8_t p = 0; p < SLEEP_PORT_COUNT; p++)
+    {
+        sleep_saved_ports[p].moder = sleep_ports[p]->MODER;
+        sleep_saved_ports[p].pupdr = sleep_ports[p]->PUPDR;
+        sleep_saved_ports[p].odr = sleep_ports[p]->ODR;
+    }
+
+    for (uint8_t i = 0; i < SLEEP_PIN_COUNT; i++)
+    {
+        const PowerSleepPin *entry = &sleep_pins[i];
+        uint32_t fields = power_pin_fields(entry->pins);
+
+        switch (entry->state)
+        {
+        case PWR_PIN_ANALOG:
+            entry->port->PUPDR &= ~fields;
+            entry->port->MODER |= fields;
+            break;
+        case PWR_PIN_LOW:
+        case PWR_PIN_HIGH:
+            entry->port->BSRR = entry->state == PWR_PIN_HIGH ?
+                entry->pins : (uint32_t)entry->pins << 16;
+            entry->port->PUPDR &= ~fields;
+            entry->port->MODER = (entry->port->MODER & ~fields) | (fields & 0x55555555);
+            break;
+        default:
+            break;
+        }
+    }
+    sleep_violations = power_audit_stop_state();
+
+    //GPIO outputs and EXTI inputs keep working without their clocks
+    sleep_saved_iopenr = RCC->IOPENR;
+    sleep_saved_ahbenr = RCC->AHBENR;
+    sleep_saved_apb1enr = RCC->APB1ENR;
+    sleep_saved_apb2enr = RCC->APB2ENR;
+    RCC->IOPENR = 0;
+    RCC->AHBENR &= RCC_AHBENR_MIFEN;
+    RCC->APB1ENR = RCC_APB1ENR_PWREN | RCC_APB1ENR_LPTIM1EN;
+    RCC->APB2ENR = RCC_APB2ENR_SYSCFGEN;
+
+    //Stop is entered from the main regulator (leaving low power run), with
+    //the low power regulator and VREFINT off, not waiting for VREFINT when
+    //waking
+    sleep_saved_pwr_cr = PWR->CR;
+    PWR->CR &= ~PWR_CR_LPRUN;
+    while (PWR->CSR & PWR_CSR_REGLPF) { }
+    PWR->CR |= PWR_CR_LPSDSR | PWR_CR_ULP | PWR_CR_FWU;
+}
+
+/**
+ * Restores the clocks and pins saved by power_enter_stop_state
+ */
+static void power_exit_stop_state(void)
+{
+    //back to low power run, or the main regulator
+    if (sleep_saved_pwr_cr & PWR_CR_LPRUN)
+        PWR->CR |= PWR_CR_LPRUN;
+    else
+        PWR->CR &= ~PWR_CR_LPSDSR;
+
+    RCC->IOPENR = sleep_saved_iopenr;
+    RCC->AHBENR = sleep_saved_ahbenr;
+    RCC->APB1ENR = sleep_saved_apb1enr;
+    RCC->APB2ENR = sleep_saved_apb2enr;
+
+    //outputs come back at their saved levels
+    for (uint8_t p = 0; p < SLEEP_PORT_COUNT; p++)
+    {
+        sleep_ports[p]->ODR = sleep_saved_ports[p].odr;
+        sleep_ports[p]->PUPDR = sleep_saved_ports[p].pupdr;
+        sleep_ports[p]->MODER = sleep_saved_ports[p].moder;
+    }
+}
+
+/**
+ * Measures VDD against VREFINT with a single ADC conversion, leaving the ADC
+ * and VREFINT off afterwards
+ *
+ * Returns VDD in millivolts
+ */
+static uint16_t power_measure_vdd(void)
+{
+    uint32_t sample;
+
+    RCC->APB2ENR |= RCC_APB2ENR_ADCEN;
+
+    //synchronous PCLK/2 is within the ADC limits at every voltage range
+    ADC1->CFGR2 = ADC_CFGR2_CKMODE_0;
+    ADC->CCR = ADC_CCR_VREFEN | (SystemCoreClock / 2 < 3500000 ? ADC_CCR_LFMEN : 0);
+
+    ADC1->CR = ADC_CR_ADVREGEN;
+    ADC1->CR |= ADC_CR_ADCAL;
+    while (ADC1->CR & ADC_CR_ADCAL) { }
+
+    ADC1->ISR = ADC_ISR_ADRDY;
+    ADC1->CR |= ADC_CR_ADEN;
+    while (!(ADC1->ISR & ADC_ISR_ADRDY)) { }
+
+    //VREFINT is off in Stop (ULP) and isn't waited for on wake (FWU)
+    while (!(SYSCFG->CFGR3 & SYSCFG_CFGR3_VREFINT_RDYF)) { }
+
+    //VREFINT needs a long sampling time
+    ADC1->CHSELR = ADC_CHSELR_CHSEL17;
+    ADC1->SMPR = ADC_SMPR_SMP;
+    ADC1->CR |= ADC_CR_ADSTART;
+    while (!(ADC1->ISR & ADC_ISR_EOC)) { }
+    sample = ADC1->DR;
+
+    ADC1->CR |= ADC_CR_ADDIS;
+    while (ADC1->CR & ADC_CR_ADEN) { }
+    ADC1->CR = 0;
+    ADC->CCR = 0;
+    RCC->APB2ENR &= ~RCC_APB2ENR_ADCEN;
+
+    return sample ? POWER_VREFINT_CAL_MV * POWER_VREFINT_CAL / sample : 0;
+}
+
+/**
+ * Takes a battery sample and adds it to the filtered battery voltage
+ */
+static void power_sample_battery(void)
+{
+    uint16_t mv = power_measure_vdd();
+
+    //first order low pass, 1/4 of each new sample
+    if (!battery_mv)
+        battery_mv = mv;
+    else
+        battery_mv = (battery_mv * 3 + mv) >> 2;
+}
+
 static PowerState power_fsm_init(void)
 {
     PowerState nextState;
 
     //analyze the initial state and call any necessary hooks
-    countdown = 0;
+    power_sample_battery();
+    deadline = ticks;
+    power_tick_start();
+    wake_stamp = last_stamp;
+    power_set_idle(false);
     hook_power_on_wake();
-    if (GPIOB->IDR & USB_PRES_MASK)
+    if (!(input_state & USB_PRES_MASK))
     {
         hook_power_on_usb_connect();
         nextState = PWR_ST_USB;
@@ -84,11 +533,11 @@ static PowerState power_fsm_init(void)
         nextState = PWR_ST_BATTERY;
     }
 
-    //Set up external interrupts from USB connect/disconnect
-    SYSCFG->EXTICR[0] |= SYSCFG_EXTICR1_EXTI0_PB;
-    EXTI->IMR |= EXTI_IMR_IM0;
-    EXTI->RTSR |= EXTI_RTSR_RT0;
-    EXTI->FTSR |= EXTI_FTSR_FT0;
+    //Set up external interrupts from USB connect/disconnect and charge status
+    SYSCFG->EXTICR[0] |= SYSCFG_EXTICR1_EXTI0_PB | SYSCFG_EXTICR1_EXTI1_PB;
+    EXTI->IMR |= EXTI_IMR_IM0 | EXTI_IMR_IM1;
+    EXTI->RTSR |= EXTI_RTSR_RT0 | EXTI_RTSR_RT1;
+    EXTI->FTSR |= EXTI_FTSR_FT0 | EXTI_FTSR_FT1;
     NVIC_EnableIRQ(EXTI0_1_IRQn);
 
     return nextState;
@@ -97,13 +546,16 @@ static PowerState power_fsm_init(void)
 static PowerState power_fsm_usb_main(void)
 {
     //we stay awake until an event changes that
-    hook_power_awake();
+    if (flags & (POWER_FLAG_TICK | POWER_FLAG_UPDATE))
+    {
+        hook_power_awake();
+    }
     return PWR_ST_USB;
 }
 
 static PowerState power_fsm_usb_disconnect(void)
 {
-    countdown = 0;
+    deadline = ticks;
     hook_power_on_usb_disconnect();
     return PWR_ST_BATTERY;
 }
@@ -116,8 +568,11 @@ static PowerState power_fsm_usb_connect(void)
 
 static PowerState power_fsm_battery_main(void)
 {
+    if (!(flags & (POWER_FLAG_TICK | POWER_FLAG_UPDATE)))
+        return PWR_ST_BATTERY;
+
     hook_power_awake();
-    if (!countdown--)
+    if ((int32_t)(ticks - deadline) >= 0)
     {
         return PWR_ST_SLEEP;
     }
@@ -129,10 +584,46 @@ static PowerState power_fsm_battery_main(void)
 
 static PowerState power_fsm_sleep_main(void)
 {
+    uint32_t reloads = 0;
+
     hook_power_on_sleep();
+
+    //the battery is sampled now rather than on the way back up, which is
+    //kept as short as possible
+    power_sample_battery();
+
+    //the MSI keeps its range through Stop, so the core wakes up already
+    //running at the clock needed for rendering
+    power_set_idle(false);
+
+    //the waking interrupt runs once everything is restored
+    __disable_irq();
+    power_account(power_run_state());
+    power_stop_timer_start();
+    power_enter_stop_state();
     SCB->SCR |= SCB_SCR_SLEEPDEEP_Msk;
-    __ASM volatile ("wfi");
-    countdown = 0;
+    while (true)
+    {
+        __WFI();
+        //stop timer reloads are counted and slept through
+        if (LPTIM1->ISR & LPTIM_ISR_ARRM)
+        {
+            LPTIM1->ICR = LPTIM_ICR_ARRMCF;
+            NVIC_ClearPendingIRQ(LPTIM1_IRQn);
+            reloads++;
+        }
+        if (NVIC->ISPR[0] & NVIC->ISER[0])
+            break;
+    }
+    SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+    residency[POWER_RES_STOP] += (((uint64_t)reloads << 16) + power_lptim_count())
+        << POWER_STOP_PRESCALE_SHIFT;
+    power_exit_stop_state();
+    power_tick_start();
+    wake_stamp = last_stamp;
+    __enable_irq();
+
+    deadline = ticks;
     hook_power_on_wake();
     return PWR_ST_BATTERY;
 }
@@ -161,18 +652,30 @@ static void power_fsm_tick(PowerEvent event)
     }
 }
 
-static PowerEvent power_get_event(uint32_t next_inputs)
+/**
+ * Samples the inputs once they have settled after an edge
+ *
+ * Returns the USB presence event for the settled inputs, or PWR_EVT_NONE if
+ * nothing is settling or USB presence did not change. Charge status changes
+ * only update the battery state.
+ */
+static PowerEvent power_get_event(void)
 {
-    uint32_t changes = input_state ^ next_inputs;
-    input_state = next_inputs;
-    if (next_inputs & USB_PRES_MASK)
-    {
-        return PWR_EVT_USB_DISCONNECT;
-    }
-    else
+    uint32_t next_inputs, changes;
+
+    __disable_irq();
+    if (!debouncing || (int32_t)(ticks - debounce_deadline) < 0)
     {
-        return PWR_EVT_USB_CONNECT;
+        __enable_irq();
+        return PWR_EVT_NONE;
     }
+    debouncing = false;
+    __enable_irq();
+
+    next_inputs = GPIOB->IDR & (USB_PRES_MASK | BAT_CHG_MASK);
+    changes = input_state ^ next_inputs;
+    input_state = next_inputs;
+
     if (changes & next_inputs & USB_PRES_MASK) //there is a usb change and the usb bit is high in the inputs
     {
         return PWR_EVT_USB_DISCONNECT;
@@ -187,15 +690,45 @@ static PowerEvent power_get_event(uint32_t next_inputs)
     }
 }
 
+/**
+ * Waits in Sleep mode until an interrupt posts an event
+ *
+ * Returns the events posted, which may be none if some unrelated interrupt
+ * woke the core.
+ */
+static uint8_t power_wait_event(void)
+{
+    uint8_t posted;
+
+    //WFI still wakes on a pending interrupt while they are masked, so an
+    //event posted between the check and the WFI is not missed
+    __disable_irq();
+    if (!events)
+    {
+        power_account(power_run_state());
+        __WFI();
+        power_account(POWER_RES_SLEEP);
+    }
+    __enable_irq();
+
+    __disable_irq();
+    posted = events;
+    events = 0;
+    __enable_irq();
+
+    return posted;
+}
+
 void power_main(void)
 {
-    uint32_t next_inputs;
     input_state = GPIOB->IDR & (USB_PRES_MASK | BAT_CHG_MASK);
 
+    //the first pass runs the initial state
+    flags = POWER_FLAG_TICK | POWER_FLAG_INPUT;
     while (true)
     {
-        next_inputs = GPIOB->IDR & (USB_PRES_MASK | BAT_CHG_MASK);
-        power_fsm_tick(power_get_event(next_inputs));
+        power_fsm_tick(power_get_event());
+        flags = power_wait_event();
     }
 }
 
@@ -215,13 +748,119 @@ PowerBatteryState power_get_battery_state(void)
     }
 }
 
-void power_set_awake_time(uint32_t ticks)
+uint16_t power_get_battery_voltage(void)
 {
-    countdown = ticks;
+    return battery_mv;
+}
+
+void power_set_awake_time(uint32_t ms)
+{
+    //a single store, so this is safe to call from interrupts
+    deadline = ticks + (ms * POWER_TICK_HZ + 999) / 1000;
+}
+
+uint32_t power_get_awake_time(void)
+{
+    int32_t remaining = deadline - ticks;
+    if (remaining <= 0)
+        return 0;
+    return (remaining * 1000) / POWER_TICK_HZ;
+}
+
+uint32_t power_get_ticks(void)
+{
+    return ticks;
+}
+
+void power_request_update(void)
+{
+    events |= POWER_FLAG_UPDATE;
+}
+
+void power_set_idle(bool next)
+{
+    if (next == idle)
+        return;
+
+    idle = next;
+    if (idle)
+        osc_release(render_clock);
+    else
+        osc_acquire(render_clock);
+}
+
+uint64_t power_get_residency(PowerResidency state)
+{
+    uint64_t clocks;
+
+    __disable_irq();
+    clocks = residency[state];
+    __enable_irq();
+
+    return lptim_hz ? clocks * 1000 / lptim_hz : 0;
+}
+
+uint32_t power_get_uptime(void)
+{
+    uint64_t clocks = 0;
+
+    __disable_irq();
+    for (uint8_t i = 0; i < POWER_RES_COUNT; i++)
+        clocks += residency[i];
+    if (lptim_hz)
+        clocks += power_timestamp() - last_stamp;
+    __enable_irq();
+
+    return lptim_hz ? clocks * 1000 / lptim_hz : 0;
+}
+
+void power_restart_tick(void)
+{
+    uint32_t primask = __get_PRIMASK();
+    uint32_t previous_hz, since_wake;
+
+    if (!lptim_hz)
+        return;
+
+    __disable_irq();
+    power_account(power_run_state());
+    previous_hz = lptim_hz;
+    since_wake = last_stamp - wake_stamp;
+    power_tick_start();
+    wake_stamp = last_stamp - (uint64_t)since_wake * lptim_hz / previous_hz;
+    __set_PRIMASK(primask);
+}
+
+uint32_t power_get_time_since_wake(void)
+{
+    uint32_t clocks;
+
+    __disable_irq();
+    clocks = power_timestamp() - wake_stamp;
+    __enable_irq();
+
+    return lptim_hz ? (uint64_t)clocks * 1000000 / lptim_hz : 0;
+}
+
+uint8_t power_get_sleep_violations(void)
+{
+    return sleep_violations;
 }
 
 void __attribute__ ((interrupt ("IRQ"))) EXTI0_1_IRQHandler()
 {
     EXTI->PR &= EXTI_PR_PIF0 | EXTI_PR_PIF1;
+
+    //every edge restarts the settling time
+    debounce_deadline = ticks + POWER_DEBOUNCE_TICKS;
+    debouncing = true;
+    events |= POWER_FLAG_INPUT;
+}
+
+void __attribute__ ((interrupt ("IRQ"))) LPTIM1_IRQHandler()
+{
+    LPTIM1->ICR = LPTIM_ICR_ARRMCF;
+    ticks++;
+    events |= POWER_FLAG_TICK;
 }
 
@@ -8,6 +8,7 @@
 
 #include "usb.h"
 #include "usb_desc.h"
+#include "osc.h"
 #include "stm32l0xx.h"
 
 #include <stdbool.h>
@@ -153,6 +154,8 @@ typedef struct {
  */
 static uint8_t endp0_buffer[64];
 
+static OscRequirement usb_clock;
+
 USBControlResult __attribute__ ((weak)) hook_usb_handle_setup_request(USBSetupPacket const *setup, USBTransferData *nextTransfer)
 {
     return USB_CTL_STALL; //default: Stall on an unhandled request
@@ -177,6 +180,9 @@ void usb_init(void)
     //Enable module clocks
     RCC->APB1ENR |= RCC_APB1ENR_USBEN | RCC_APB1ENR_CRSEN;
     RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+
+    //The peripheral needs the HSI16 system clock while enabled
+    usb_clock = osc_add_requirement(OSC_HSI16_FREQUENCY);
 }
 
 /**
@@ -184,6 +190,8 @@ void usb_init(void)
  */
 void usb_enable(void)
 {
+    osc_acquire(usb_clock);
+
     //Enable the VREF for HSI48
     SYSCFG->CFGR3 |= 0x01;
     while (!(SYSCFG->CFGR3 & SYSCFG_CFGR3_VREFINT_RDYF)) { }
@@ -229,6 +237,8 @@ void usb_disable(void)
 
     //Disable the VREF for HSI48
     SYSCFG->CFGR3 &= ~SYSCFG_CFGR3_ENREF_HSI48;
+
+    osc_release(usb_clock);
 }
 
 /**
@@ -0,0 +1,116 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#ifndef _ALARMS_H_
+#define _ALARMS_H_
+
+#include <stdint.h>
+
+#include "rtc.h"
+
+/**
+ * Alarms and chime
+ *
+ * The alarm table and the hourly chime are kept in EEPROM. The table is
+ * sorted by time of day, so the next due alarm is the first match after the
+ * current time. Only that one is programmed into RTC alarm A and the next
+ * chime outside of the quiet hours into RTC alarm B. Nothing runs between
+ * them: the RTC wakes the core from Stop when one is due, and they are
+ * rescheduled after each fires.
+ */
+
+#define ALARMS_COUNT 8
+
+/**
+ * Actions taken when an alarm or the chime fires
+ *
+ * ALARM_ACTION_BUZZER: Beep the buzzer
+ * ALARM_ACTION_DISPLAY: Show the face as if a button had woken the watch
+ */
+typedef enum { ALARM_ACTION_BUZZER = 0x1, ALARM_ACTION_DISPLAY = 0x2 } AlarmAction;
+
+/**
+ * Alarm table entry, one EEPROM word
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t hours; //0-23
+    uint8_t minutes; //0-59
+    uint8_t weekdays; //bit n: weekday n + 1 (Monday = bit 0), 0 if unused
+    uint8_t actions; //AlarmAction bits
+} Alarm;
+
+/**
+ * Hourly chime, one EEPROM word
+ */
+typedef struct __attribute__((packed)) {
+    uint8_t minute; //0-59, minute of every hour to chime at
+    uint8_t actions; //AlarmAction bits, 0 if the chime is off
+    uint8_t quiet_start; //0-23, first hour without a chime
+    uint8_t quiet_end; //0-23, first hour with a chime again. No quiet hours if equal to quiet_start.
+} Chime;
+
+/**
+ * Alarm settings as exchanged with the host
+ */
+typedef struct __attribute__((packed)) {
+    Alarm alarms[ALARMS_COUNT];
+    Chime chime;
+} AlarmsConfig;
+
+/**
+ * Programs the RTC alarms for the next due alarm and chime. This must be
+ * called whenever the time is changed. It is ignored while the RTC clock is
+ * starting. This may be called from interrupts.
+ */
+void alarms_schedule(void);
+
+/**
+ * Sounds the buzzer while an alarm rings and schedules the alarms once the
+ * RTC clock runs. This must be called every awake tick.
+ */
+void alarms_tick(void);
+
+/**
+ * Handles a fired RTC alarm. This is meant to be called from hook_rtc_alarm.
+ *
+ * alarm: RTC alarm which fired
+ */
+void alarms_fired(RTCAlarm alarm);
+
+/**
+ * Returns the actions of the alarms fired since the last call and clears
+ * them
+ */
+uint8_t alarms_take_actions(void);
+
+/**
+ * Returns the milliseconds until the buzzer stops ringing, or 0 if it isn't
+ */
+uint32_t alarms_get_ring_time(void);
+
+/**
+ * Stops the buzzer ringing. This may be called from interrupts.
+ */
+void alarms_silence(void);
+
+/**
+ * Gets the alarm settings
+ *
+ * dest: Settings to fill out
+ */
+void alarms_get_config(AlarmsConfig *dest);
+
+/**
+ * Stores new alarm settings in EEPROM and reschedules the alarms. The alarms
+ * are sorted on the way, so they may be stored in a different order. Only
+ * the words which changed are written. The core voltage must be in range 1
+ * or 2 for the EEPROM to be written.
+ *
+ * config: New settings
+ */
+void alarms_set_config(const AlarmsConfig *config);
+
+#endif //_ALARMS_H_
@@ -0,0 +1,106 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#ifndef _ANIMATION_H_
+#define _ANIMATION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Keyframe animations
+ *
+ * Animations are compact keyframe tables kept in flash. Each keyframe lights
+ * a span of minute LEDs at one level for a number of display frames, and may
+ * repeat itself while stepping the span and level, so a whole sweep or fade
+ * is a single keyframe. A keyframe lasting 0 frames is drawn together with
+ * the keyframes following it, which composes multi-level pictures such as a
+ * comet tail. Such keyframes are drawn at the repetition of the keyframe they
+ * are composed with, so they move along with it.
+ *
+ * Playing animations are advanced by the display frame counter (see
+ * leds_get_frame_count) rather than by how often animation_update is called,
+ * and are rendered into a display layer. An animation which dims draws no
+ * spans. The level of its current keyframe limits the levels of the whole
+ * face instead (see layers_set_limit), until it stops.
+ */
+
+#define ANIMATION_SLOTS 2
+
+typedef struct {
+    uint8_t frames; //display frames each repetition is shown for
+    uint8_t repeat; //number of repetitions, 0 is treated as 1
+    uint8_t level; //level (0-3) of the span
+    int8_t first; //first LED of the span, relative to the animation origin
+    uint8_t count; //LEDs in the span, clockwise from first (0-60)
+    int8_t level_step; //added to level after each repetition
+    int8_t first_step; //added to first after each repetition
+    int8_t count_step; //added to count after each repetition
+} AnimationKeyframe;
+
+typedef struct {
+    const AnimationKeyframe *keyframes;
+    uint8_t count;
+    bool loop;
+    bool dims; //keyframe levels limit the face instead of drawing spans
+} Animation;
+
+/**
+ * Stock animations
+ */
+extern const Animation animation_wake_sweep;
+extern const Animation animation_fade_out;
+extern const Animation animation_comet; //second hand, played from its LED each second
+
+/**
+ * Initializes the animation engine
+ */
+void animation_init(void);
+
+/**
+ * Starts playing an animation into a layer, replacing any animation already
+ * playing into it. When a non-looping animation ends, the layer is emptied.
+ *
+ * layer: Layer to render into
+ * animation: Animation to play
+ * origin: Minute LED (0-59) the keyframe spans are relative to
+ */
+void animation_play(uint8_t layer, const Animation *animation, uint8_t origin);
+
+/**
+ * Stops the animation playing into a layer and empties the layer
+ *
+ * layer: Layer the animation renders into
+ */
+void animation_stop(uint8_t layer);
+
+/**
+ * Returns whether an animation is playing into a layer
+ *
+ * layer: Layer the animation renders into
+ */
+bool animation_is_playing(uint8_t layer);
+
+/**
+ * Advances all playing animations by the display frames shown since the last
+ * call and renders those that changed. Returns immediately if no frame has
+ * been shown.
+ */
+void animation_update(void);
+
+/**
+ * Gets the number of display frames until a playing animation next changes,
+ * 0 if one is due now, or 0xFFFF if none are playing
+ */
+uint16_t animation_get_frames_until_change(void);
+
+/**
+ * Gets the core cycles spent rendering during the last animation_update
+ * which rendered anything
+ */
+uint32_t animation_get_render_cycles(void);
+
+#endif //_ANIMATION_H_
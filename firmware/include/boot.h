@@ -0,0 +1,58 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#ifndef _BOOT_H_
+#define _BOOT_H_
+
+#include <stdint.h>
+
+/**
+ * Boot timeline
+ *
+ * Records when the firmware reaches a few milestones after reset, measured
+ * with SysTick cycles. The cycles are converted at the clock they ran at,
+ * since the clock governor switches clocks during the boot.
+ */
+
+/**
+ * Boot milestones
+ *
+ * BOOT_STAGE_INIT: Every module is initialized and the power loop starts
+ * BOOT_STAGE_FIRST_FRAME: The first display frame is shown
+ * BOOT_STAGE_RTC_CLOCK: The RTC clock is running (see rtc_poll)
+ */
+typedef enum { BOOT_STAGE_INIT, BOOT_STAGE_FIRST_FRAME, BOOT_STAGE_RTC_CLOCK, BOOT_STAGE_COUNT } BootStage;
+
+/**
+ * Starts the boot timeline. This must be called first thing in main.
+ */
+void boot_start(void);
+
+/**
+ * Records reaching a milestone, unless it was reached before. This may be
+ * called from interrupts.
+ *
+ * stage: Milestone reached
+ */
+void boot_mark(BootStage stage);
+
+/**
+ * Keeps the timeline running until every milestone is reached. This must be
+ * called more often than SysTick wraps (about a second at 16MHz), e.g. every
+ * awake tick.
+ */
+void boot_tick(void);
+
+/**
+ * Gets the time a milestone was reached
+ *
+ * stage: Milestone
+ *
+ * Returns microseconds since boot_start, or 0 if it wasn't reached yet
+ */
+uint32_t boot_get_time(BootStage stage);
+
+#endif //_BOOT_H_
@@ -6,6 +6,8 @@
 #ifndef _BUZZER_H_
 #define _BUZZER_H_
 
+#include <stdint.h>
+
 /**
  * Initializes the buzzer
  */
@@ -16,5 +18,10 @@ void buzzer_init(void);
  */
 void buzzer_trigger_beep(void);
 
+/**
+ * Returns the total time the buzzer has sounded since reset in milliseconds
+ */
+uint32_t buzzer_get_on_time(void);
+
 #endif //_BUZZER_H_
 
@@ -0,0 +1,84 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#ifndef _LAYERS_H_
+#define _LAYERS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "leds.h"
+
+/**
+ * Display layers
+ *
+ * The face is composed from a small stack of layers, each holding an LED
+ * image. Layers with a higher index have priority and their lit LEDs are
+ * drawn over the lower ones. The layers are only composited into the LED
+ * edit buffer and committed when one of them changes, so unchanged content
+ * costs nothing.
+ */
+
+#define LAYERS_COUNT 8
+
+/**
+ * Initializes the layers. All layers start out disabled and empty.
+ */
+void layers_init(void);
+
+/**
+ * Sets the content of a layer
+ *
+ * layer: Layer index (0 to LAYERS_COUNT - 1)
+ * bitmap: LEDs shown by the layer
+ * level: Level (0-3) the LEDs are shown at
+ */
+void layers_set(uint8_t layer, const LEDBitmap *bitmap, uint8_t level);
+
+/**
+ * Sets the content of a layer to an image with LEDs at different levels
+ *
+ * layer: Layer index (0 to LAYERS_COUNT - 1)
+ * image: Image shown by the layer
+ */
+void layers_set_image(uint8_t layer, const LEDImage *image);
+
+/**
+ * Enables or disables a layer
+ *
+ * layer: Layer index
+ * enabled: Whether the layer is drawn
+ */
+void layers_set_enabled(uint8_t layer, bool enabled);
+
+/**
+ * Sets the blink rate of a layer
+ *
+ * layer: Layer index
+ * ticks: Number of layers_tick calls the layer is shown and then hidden for,
+ *   or 0 to stop blinking
+ */
+void layers_set_blink(uint8_t layer, uint8_t ticks);
+
+/**
+ * Limits the level of every LED shown, whichever layer it comes from. This
+ * dims the composed face without changing the layers.
+ *
+ * level: Highest level (0-3) shown, 3 to show every level
+ */
+void layers_set_limit(uint8_t level);
+
+/**
+ * Advances the blinking layers by one tick
+ */
+void layers_tick(void);
+
+/**
+ * Composites the layers and commits them to the display if any layer changed
+ */
+void layers_update(void);
+
+#endif //_LAYERS_H_
@@ -4,7 +4,49 @@
  * Kevin Cuzner
  */
 
+#ifndef _LEDS_H_
+#define _LEDS_H_
+
 #include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * LED levels (0-3) are stored as bit planes. Plane n holds bit n of every
+ * LED's level.
+ */
+#define LEDS_PLANE_COUNT 2
+
+#define LEDS_MINUTE_COUNT 60
+#define LEDS_HOUR_COUNT 12
+#define LEDS_CENTER_RED 0x1
+#define LEDS_CENTER_GREEN 0x2
+
+/**
+ * Logical LED bitmap with one bit per LED in display order, independent of
+ * how the LEDs are wired to the mux
+ */
+typedef struct {
+    uint64_t minutes; //bit n: minute LED n (0-59)
+    uint16_t hours; //bit n: hour LED n (0-11)
+    uint8_t center; //LEDS_CENTER_* bits
+} LEDBitmap;
+
+/**
+ * Logical LED image holding a level (0-3) for every LED as bit planes
+ */
+typedef struct {
+    LEDBitmap planes[LEDS_PLANE_COUNT];
+} LEDImage;
+
+/**
+ * Display multiplexing modes
+ *
+ * LEDS_MODE_INTERRUPT: TIM21 interrupts drive every mux step
+ * LEDS_MODE_DMA: TIM2 events trigger DMA transfers of a table built by
+ *   leds_commit into the GPIO ports. Only the end of each frame raises an
+ *   interrupt, so the core may sleep while the face is lit.
+ */
+typedef enum { LEDS_MODE_INTERRUPT, LEDS_MODE_DMA } LEDMode;
 
 /**
  * Initializes the LEDs
@@ -14,15 +56,74 @@
 void leds_init(void);
 
 /**
- * Starts the LED display
+ * Starts the LED display. While running, the display holds a clock governor
+ * requirement for the slowest clock that sustains its refresh rate.
  */
 void leds_enable(void);
 
 /**
- * Stops the LED display
+ * Stops the LED display and releases its clock requirement
  */
 void leds_disable(void);
 
+/**
+ * Returns whether the LED display is running
+ */
+bool leds_is_enabled(void);
+
+/**
+ * Estimates the load of the committed image for power accounting: the
+ * number of fully lit LEDs with the same average current, in hundredths.
+ * Each LED counts in proportion to its level and the global brightness.
+ */
+uint16_t leds_get_load(void);
+
+/**
+ * Selects the display multiplexing mode. The committed image is rebuilt and,
+ * if the display is running, it is restarted in the new mode.
+ *
+ * mode: Multiplexing mode
+ */
+void leds_set_mode(LEDMode mode);
+
+/**
+ * Sets the display refresh rate. The timer settings are recomputed from the
+ * core clock whenever the oscillator changes so the rate is kept, and the
+ * display clock requirement follows leds_get_min_msi_range.
+ *
+ * hz: Complete refreshes per second
+ * levels: Brightness levels to show, 2 (on/off) or 4. With 2 levels only the
+ *   upper bit of each LED level is shown, which halves the refresh steps.
+ */
+void leds_set_refresh(uint16_t hz, uint8_t levels);
+
+/**
+ * Sets the global display brightness. The mux enable line is only driven
+ * for part of every step: in interrupt mode the lit steps are shortened and
+ * the remainder is added to the frame's blank step, in DMA mode a TIM2
+ * compare channel disables the mux. Neither adds interrupts.
+ *
+ * percent: Duty cycle of the lit LEDs, 1-100
+ */
+void leds_set_brightness(uint8_t percent);
+
+/**
+ * Recomputes the display timing for the current core clock. This is
+ * registered as an oscillator change callback by leds_init.
+ */
+void leds_set_timing(void);
+
+/**
+ * Gets the lowest MSI range which can sustain a refresh rate in the current
+ * display mode without flicker
+ *
+ * hz: Complete refreshes per second
+ * levels: Brightness levels to show, 2 or 4
+ *
+ * Returns the MSI range (0-6) or 7 if no MSI range is fast enough
+ */
+uint8_t leds_get_min_msi_range(uint16_t hz, uint8_t levels);
+
 /**
  * Clears the LEDs in the current buffer
  */
@@ -57,3 +158,101 @@ void leds_set_center(uint8_t red, uint8_t green, uint8_t blue);
  */
 void leds_commit(void);
 
+/**
+ * Sets every LED in a bitmap to some level, leaving the other LEDs untouched
+ *
+ * bitmap: LEDs to set
+ * level: Level (0-3)
+ */
+void leds_draw_bitmap(const LEDBitmap *bitmap, uint8_t level);
+
+/**
+ * Draws the lit (non-zero level) LEDs of an image over the current buffer
+ *
+ * image: Image to draw
+ */
+void leds_draw_image(const LEDImage *image);
+
+/**
+ * Gets the number of frames shown since the display was initialized. This is
+ * the display timer tick: it advances once per complete refresh while the
+ * display is enabled and wraps around.
+ */
+uint16_t leds_get_frame_count(void);
+
+/**
+ * Hook called from the display interrupt for the first frame after the
+ * display is started: when its first step is output in interrupt mode, or
+ * once the whole frame has been output in DMA mode
+ */
+void hook_leds_first_frame(void);
+
+/**
+ * Clears an image
+ */
+void leds_image_clear(LEDImage *image);
+
+/**
+ * Sets every LED of an image which is in a bitmap to some level
+ *
+ * image: Image to modify
+ * bitmap: LEDs to set
+ * level: Level (0-3)
+ */
+void leds_image_set(LEDImage *image, const LEDBitmap *bitmap, uint8_t level);
+
+/**
+ * Lowers every LED of an image which is above some level to that level
+ *
+ * image: Image to modify
+ * level: Highest level (0-3) left in the image
+ */
+void leds_image_limit(LEDImage *image, uint8_t level);
+
+/**
+ * Clears a bitmap
+ */
+void leds_bitmap_clear(LEDBitmap *bitmap);
+
+/**
+ * Sets a range of minute LEDs in a bitmap, wrapping past 59 to 0
+ *
+ * bitmap: Bitmap to modify
+ * first: First LED of the range (0-59)
+ * count: Number of LEDs in the range (0-60)
+ */
+void leds_bitmap_set_minutes(LEDBitmap *bitmap, uint8_t first, uint8_t count);
+
+/**
+ * Rotates the minute ring of a bitmap clockwise
+ *
+ * bitmap: Bitmap to modify
+ * count: Number of LEDs to rotate by (0-59)
+ */
+void leds_bitmap_rotate_minutes(LEDBitmap *bitmap, uint8_t count);
+
+/**
+ * Rotates the hour ring of a bitmap clockwise
+ *
+ * bitmap: Bitmap to modify
+ * count: Number of LEDs to rotate by (0-11)
+ */
+void leds_bitmap_rotate_hours(LEDBitmap *bitmap, uint8_t count);
+
+/**
+ * Clears every LED of a bitmap which is not set in a mask
+ *
+ * bitmap: Bitmap to modify
+ * mask: LEDs to keep
+ */
+void leds_bitmap_mask(LEDBitmap *bitmap, const LEDBitmap *mask);
+
+/**
+ * Sets every LED of a bitmap which is set in another bitmap
+ *
+ * bitmap: Bitmap to modify
+ * other: LEDs to add
+ */
+void leds_bitmap_or(LEDBitmap *bitmap, const LEDBitmap *other);
+
+#endif //_LEDS_H_
@@ -0,0 +1,62 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#ifndef _RESIDENCY_H_
+#define _RESIDENCY_H_
+
+#include <stdint.h>
+
+/**
+ * Energy residency counters
+ *
+ * Collects the time spent in each power state along with the time the
+ * display and buzzer were on, so the host can estimate where the battery
+ * goes. Power states come from the power module. The display is sampled
+ * every awake tick. The latency of the last wake, from leaving Stop mode to
+ * the first display frame, the cost of the last animation render and the
+ * pins left undefined when last entering Stop mode are kept along with
+ * them.
+ */
+
+/**
+ * Counters as sent to the host, in seconds since reset unless noted. Whole
+ * seconds in 32 bits last far longer than the battery, where milliseconds
+ * would wrap after 49 days.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t run_msi;
+    uint32_t run_hsi16;
+    uint32_t run_lprun;
+    uint32_t sleep;
+    uint32_t stop;
+    uint32_t display;
+    uint32_t buzzer;
+    uint32_t lit_leds; //LED-seconds of fully lit LEDs (see leds_get_load)
+    uint32_t wake_latency; //microseconds (see power_get_time_since_wake)
+    uint32_t render_cycles; //core cycles (see animation_get_render_cycles)
+    uint8_t sleep_violations; //pins (see power_get_sleep_violations)
+} ResidencyReport;
+
+/**
+ * Samples the display. Must be called every awake tick, further calls
+ * within the same tick are ignored.
+ */
+void residency_tick(void);
+
+/**
+ * Records the wake latency. Must be called when the first display frame
+ * after waking is shown (see hook_leds_first_frame).
+ */
+void residency_first_frame(void);
+
+/**
+ * Gets the current counters
+ *
+ * report: Report to fill out
+ */
+void residency_get_report(ResidencyReport *report);
+
+#endif //_RESIDENCY_H_
@@ -11,36 +11,182 @@
 #include <stdbool.h>
 
 /**
- * Initializes the real-time clock, including the LSE oscillator
+ * Calendar values read at one instant
+ */
+typedef struct {
+    uint8_t year; //0-99
+    uint8_t month; //1-12
+    uint8_t day; //1-31
+    uint8_t weekday; //1-7, Monday = 1
+    uint8_t hours; //0-23
+    uint8_t minutes;
+    uint8_t seconds;
+    uint16_t milliseconds; //0-999, since the second started
+} RTCSnapshot;
+
+/**
+ * RTC clock sources
+ *
+ * RTC_CLOCK_STARTING: The LSE is starting and the RTC isn't running yet
+ * RTC_CLOCK_LSE: The RTC runs from the 32.768KHz crystal
+ * RTC_CLOCK_LSI: The LSE didn't start and the RTC runs from the LSI. Time is
+ *   only kept to within the LSI tolerance (several percent).
+ */
+typedef enum { RTC_CLOCK_STARTING, RTC_CLOCK_LSE, RTC_CLOCK_LSI } RTCClock;
+
+/**
+ * RTC alarms. Each matches one time of day, on every day or one weekday.
+ */
+typedef enum { RTC_ALARM_A, RTC_ALARM_B } RTCAlarm;
+
+/**
+ * Weekday for an alarm which matches every day
+ */
+#define RTC_ALARM_DAILY 0
+
+/**
+ * Initializes the real-time clock, including the LSE oscillator. This
+ * doesn't wait for the LSE: unless the RTC kept running through the reset,
+ * it only starts once rtc_poll finds the LSE ready.
  */
 void rtc_init(void);
 
+/**
+ * Finishes starting the RTC clock. This must be called every awake tick. It
+ * selects the LSE once it is ready, or falls back to the LSI if it doesn't
+ * start within 15 awake seconds. Until then the calendar reads as zero and
+ * cannot be set. If the LSE comes up after the fallback but before the
+ * calendar is set, the RTC is reset and restarted on the LSE.
+ */
+void rtc_poll(void);
+
+/**
+ * Returns the clock the RTC runs from
+ */
+RTCClock rtc_get_clock(void);
+
 /**
  * Returns whether or not the RTC time has been set
  */
 bool rtc_is_set(void);
 
 /**
- * Sets the RTC
+ * Sets the RTC. This is ignored while its clock is starting.
  *
  * year: Year (0-99)
  * month: Month (1-12)
  * day: Day (1-31)
+ * weekday: Weekday of the date (1-7, Monday = 1). The RTC only counts it on
+ *   from here, so it isn't checked against the date. Out of range, the
+ *   current weekday is kept.
  * hour: Hour (0-23)
  * minute: Minute (0-59)
  * second: Second (0-59)
  */
-void rtc_set(uint8_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second);
+void rtc_set(uint8_t year, uint8_t month, uint8_t day, uint8_t weekday, uint8_t hour, uint8_t minute, uint8_t second);
 
 /**
  * Refreshes the program-stored RTC calendar values from the RTC module
  *
- * This ensures the various getters are synchronized
+ * While the tick is enabled this is done at every second boundary by the RTC
+ * interrupt, so it is only needed when the tick has been off (e.g. after a
+ * wake from Stop). The calendar is read with the shadow registers bypassed,
+ * so this never waits for them to resynchronize.
  */
 void rtc_refresh(void);
 
 /**
- * Gets the current hours value
+ * Returned by rtc_sync when the date differed, or no time was set
+ */
+#define RTC_SYNC_SET INT32_MIN
+
+/**
+ * Brings the calendar to a time with millisecond precision. Offsets of less
+ * than a second are applied with a shift, which doesn't stop the calendar
+ * or restart the current second. Larger ones set the calendar (see rtc_set)
+ * and shift in the milliseconds.
+ *
+ * target: Time the calendar should be at now. The weekday is only used if
+ *   the calendar is set.
+ *
+ * Returns the milliseconds the calendar was advanced by (negative if it was
+ * ahead), or RTC_SYNC_SET if the date differed
+ */
+int32_t rtc_sync(const RTCSnapshot *target);
+
+/**
+ * Starts refreshing the calendar values from the RTC wakeup interrupt at
+ * every second boundary. The interrupt wakes the core from Stop mode, so
+ * the tick should only be enabled while awake.
+ */
+void rtc_enable_tick(void);
+
+/**
+ * Stops refreshing the calendar values every second
+ */
+void rtc_disable_tick(void);
+
+/**
+ * Reads the calendar from the RTC module now, leaving the refreshed values
+ * alone. The time, date and milliseconds are read so that they belong
+ * together.
+ *
+ * dest: Snapshot to fill out
+ */
+void rtc_read_now(RTCSnapshot *dest);
+
+/**
+ * Gets the time until the next second boundary, read from the RTC module
+ *
+ * Returns the milliseconds until the seconds change (1-1000)
+ */
+uint16_t rtc_get_ms_until_next_second(void);
+
+/**
+ * Hook called from the RTC interrupt at every second boundary while the
+ * tick is enabled, after the calendar values are refreshed
+ */
+void hook_rtc_second(void);
+
+/**
+ * Programs an alarm to fire at the start of a minute. The alarm interrupt
+ * wakes the core from Stop mode, so nothing has to run until it fires. It
+ * stays programmed and fires again at the next match until cleared. This
+ * is ignored while the RTC clock is starting.
+ *
+ * alarm: Alarm to program
+ * weekday: Weekday to match (1-7, Monday = 1) or RTC_ALARM_DAILY
+ * hours: Hour to match (0-23)
+ * minutes: Minute to match (0-59)
+ */
+void rtc_set_alarm(RTCAlarm alarm, uint8_t weekday, uint8_t hours, uint8_t minutes);
+
+/**
+ * Disables an alarm and clears it if it fired
+ *
+ * alarm: Alarm to disable
+ */
+void rtc_clear_alarm(RTCAlarm alarm);
+
+/**
+ * Hook called from the RTC interrupt when an alarm fires, after the
+ * calendar values are refreshed
+ *
+ * alarm: Alarm which fired
+ */
+void hook_rtc_alarm(RTCAlarm alarm);
+
+/**
+ * Gets a copy of the calendar values, all from the same refresh. This
+ * doesn't block or disable interrupts.
+ *
+ * dest: Snapshot to fill out
+ */
+void rtc_get_snapshot(RTCSnapshot *dest);
+
+/**
+ * Gets the current hours value. The individual getters may return values
+ * from different refreshes, use rtc_get_snapshot to get a consistent set.
  */
 uint8_t rtc_get_hours(void);
 
@@ -0,0 +1,275 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#include "alarms.h"
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "stm32l0xx.h"
+#include "nvm.h"
+#include "buzzer.h"
+#include "power.h"
+
+//An alarm beeps every half second for a few seconds, the chime beeps once
+#define ALARMS_BEEP_TICKS (POWER_TICK_HZ / 2)
+#define ALARMS_ALARM_BEEPS 8
+#define ALARMS_CHIME_BEEPS 1
+
+#define MINUTES_PER_DAY (24 * 60)
+
+static _EEPROM AlarmsConfig stored __attribute__((aligned(4)));
+
+//Alarm A time, kept to find every alarm due with it when it fires
+static uint8_t next_weekday;
+static uint16_t next_minute; //of the day
+static bool scheduled;
+
+static volatile uint8_t pending_actions;
+static volatile uint8_t ring_beeps;
+static volatile uint32_t next_beep_tick;
+
+/**
+ * Returns the minute of the day of an alarm, or a value past the end of
+ * the day if the alarm is unused so that those sort last
+ */
+static uint16_t alarms_sort_key(const Alarm *alarm)
+{
+    if (!alarm->weekdays)
+        return MINUTES_PER_DAY;
+    return alarm->hours * 60 + alarm->minutes;
+}
+
+/**
+ * Finds the first alarm due after the current minute
+ *
+ * now: Current time
+ * weekday: Set to the weekday it is due on (1-7)
+ *
+ * Returns the alarm, or NULL if every alarm is unused
+ */
+static const Alarm *alarms_find_next(const RTCSnapshot *now, uint8_t *weekday)
+{
+    uint16_t minute = now->hours * 60 + now->minutes;
+
+    //the RTC never counts weekday 0, but a calendar which was never set may
+    //not have a valid one
+    if (now->weekday < 1 || now->weekday > 7)
+        return NULL;
+
+    //the table is sorted, so the first match on the earliest day is next. A
+    //week later the alarms before now on the same weekday come up again.
+    for (uint8_t day = 0; day <= 7; day++)
+    {
+        uint8_t wd = now->weekday - 1 + day; //0-6
+
+        if (wd >= 7)
+            wd -= 7;
+
+        for (uint8_t i = 0; i < ALARMS_COUNT; i++)
+        {
+            const Alarm *alarm = &stored.alarms[i];
+            uint16_t key = alarms_sort_key(alarm);
+
+            if (key >= MINUTES_PER_DAY)
+                break;
+            if (!(alarm->weekdays & (1 << wd)) || (day == 0 && key <= minute))
+                continue;
+            *weekday = wd + 1;
+            return alarm;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns whether the chime is silent in an hour
+ */
+static bool alarms_is_quiet(const Chime *chime, uint8_t hour)
+{
+    if (chime->quiet_start <= chime->quiet_end)
+        return hour >= chime->quiet_start && hour < chime->quiet_end;
+    return hour >= chime->quiet_start || hour < chime->quiet_end;
+}
+
+void alarms_schedule(void)
+{
+    RTCSnapshot now;
+    const Alarm *alarm;
+    uint8_t weekday;
+    uint8_t hour;
+    uint32_t primask;
+
+    if (rtc_get_clock() == RTC_CLOCK_STARTING)
+        return;
+
+    //the RTC interrupt reschedules too
+    primask = __get_PRIMASK();
+    __disable_irq();
+
+    rtc_read_now(&now);
+
+    alarm = alarms_find_next(&now, &weekday);
+    if (alarm)
+    {
+        next_weekday = weekday;
+        next_minute = alarms_sort_key(alarm);
+        rtc_set_alarm(RTC_ALARM_A, weekday, alarm->hours, alarm->minutes);
+    }
+    else
+    {
+        rtc_clear_alarm(RTC_ALARM_A);
+    }
+
+    //alarm B only matches the next hour outside of the quiet hours, so they
+    //don't wake the core at all
+    rtc_clear_alarm(RTC_ALARM_B);
+    if (stored.chime.actions && stored.chime.minute < 60)
+    {
+        hour = now.minutes < stored.chime.minute ? now.hours : now.hours + 1;
+        for (uint8_t i = 0; i < 24; i++, hour++)
+        {
+            if (hour >= 24)
+                hour -= 24;
+            if (!alarms_is_quiet(&stored.chime, hour))
+            {
+                rtc_set_alarm(RTC_ALARM_B, RTC_ALARM_DAILY, hour, stored.chime.minute);
+                break;
+            }
+        }
+    }
+
+    scheduled = true;
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Starts beeping the buzzer
+ *
+ * beeps: Number of beeps
+ */
+static void alarms_ring(uint8_t beeps)
+{
+    if (beeps > ring_beeps)
+        ring_beeps = beeps;
+    next_beep_tick = power_get_ticks();
+}
+
+void alarms_tick(void)
+{
+    if (!scheduled)
+        alarms_schedule();
+
+    if (!ring_beeps || (int32_t)(power_get_ticks() - next_beep_tick) < 0)
+        return;
+
+    buzzer_trigger_beep();
+    ring_beeps--;
+    next_beep_tick = power_get_ticks() + ALARMS_BEEP_TICKS;
+}
+
+void alarms_fired(RTCAlarm alarm)
+{
+    uint8_t actions = 0;
+    uint8_t beeps = ALARMS_ALARM_BEEPS;
+
+    if (alarm == RTC_ALARM_A)
+    {
+        //alarms set for the same time share one RTC alarm
+        for (uint8_t i = 0; i < ALARMS_COUNT; i++)
+        {
+            const Alarm *entry = &stored.alarms[i];
+            if (alarms_sort_key(entry) == next_minute &&
+                    (entry->weekdays & (1 << (next_weekday - 1))))
+                actions |= entry->actions;
+        }
+    }
+    else
+    {
+        actions = stored.chime.actions;
+        beeps = ALARMS_CHIME_BEEPS;
+    }
+
+    pending_actions |= actions;
+    if (actions & ALARM_ACTION_BUZZER)
+        alarms_ring(beeps);
+
+    alarms_schedule();
+}
+
+uint8_t alarms_take_actions(void)
+{
+    uint8_t actions;
+
+    __disable_irq();
+    actions = pending_actions;
+    pending_actions = 0;
+    __enable_irq();
+
+    return actions;
+}
+
+uint32_t alarms_get_ring_time(void)
+{
+    return (uint32_t)ring_beeps * ALARMS_BEEP_TICKS * 1000 / POWER_TICK_HZ;
+}
+
+void alarms_silence(void)
+{
+    ring_beeps = 0;
+}
+
+void alarms_get_config(AlarmsConfig *dest)
+{
+    memcpy(dest, &stored, sizeof(AlarmsConfig));
+}
+
+/**
+ * Writes a word of the settings to EEPROM if it changed
+ *
+ * dest: Word in EEPROM
+ * src: New value
+ */
+static void alarms_store(void *dest, const void *src)
+{
+    uint32_t word;
+
+    memcpy(&word, src, sizeof(word));
+    if (*(uint32_t *)dest != word)
+        nvm_eeprom_write_w(dest, word);
+}
+
+void alarms_set_config(const AlarmsConfig *config)
+{
+    AlarmsConfig sorted;
+    Alarm alarm;
+    uint8_t i, j;
+
+    //invalid entries are stored as unused
+    memcpy(&sorted, config, sizeof(AlarmsConfig));
+    for (i = 0; i < ALARMS_COUNT; i++)
+    {
+        Alarm *entry = &sorted.alarms[i];
+        entry->weekdays &= 0x7F;
+        if (entry->hours >= 24 || entry->minutes >= 60 || !entry->actions)
+            memset(entry, 0, sizeof(Alarm));
+    }
+
+    //insertion sort, there are only a few
+    for (i = 1; i < ALARMS_COUNT; i++)
+    {
+        alarm = sorted.alarms[i];
+        for (j = i; j > 0 && alarms_sort_key(&sorted.alarms[j - 1]) > alarms_sort_key(&alarm); j--)
+            sorted.alarms[j] = sorted.alarms[j - 1];
+        sorted.alarms[j] = alarm;
+    }
+
+    for (i = 0; i < ALARMS_COUNT; i++)
+        alarms_store(&stored.alarms[i], &sorted.alarms[i]);
+    alarms_store(&stored.chime, &sorted.chime);
+
+    alarms_schedule();
+}
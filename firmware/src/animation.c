@@ -0,0 +1,322 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#include "animation.h"
+
+#include "stm32l0xx.h"
+#include "leds.h"
+#include "layers.h"
+
+#include <string.h>
+
+#define SYSTICK_MAX 0xFFFFFF
+
+typedef struct {
+    const Animation *animation;
+    uint8_t layer;
+    uint8_t origin;
+    uint8_t group; //first keyframe drawn together with the current one
+    uint8_t keyframe;
+    uint8_t step; //repetition of the current keyframe
+    uint8_t frames; //frames left in this repetition
+} AnimationSlot;
+
+static const AnimationKeyframe wake_sweep_keyframes[] = {
+    //grow a ring clockwise from the origin, one LED per frame
+    { 1, 60, 3, 0, 1, 0, 0, 1 },
+};
+
+static const AnimationKeyframe fade_out_keyframes[] = {
+    //the face as shown, stepping down one level every 10 frames and then
+    //held dark until the display stops
+    { 10, 3, 2, 0, 0, -1, 0, 0 },
+    { 255, 1, 0, 0, 0, 0, 0, 0 },
+};
+
+static const AnimationKeyframe comet_keyframes[] = {
+    //level 3 head with a two LED tail at level 1 which shrinks to one
+    { 0, 1, 1, -2, 2, 0, 0, 0 },
+    { 20, 1, 3, 0, 1, 0, 0, 0 },
+    { 0, 1, 1, -1, 1, 0, 0, 0 },
+    { 255, 1, 3, 0, 1, 0, 0, 0 },
+};
+
+const Animation animation_wake_sweep = {
+    wake_sweep_keyframes, sizeof(wake_sweep_keyframes)/sizeof(*wake_sweep_keyframes), false, false
+};
+
+const Animation animation_fade_out = {
+    fade_out_keyframes, sizeof(fade_out_keyframes)/sizeof(*fade_out_keyframes), false, true
+};
+
+const Animation animation_comet = {
+    comet_keyframes, sizeof(comet_keyframes)/sizeof(*comet_keyframes), false, false
+};
+
+static AnimationSlot slots[ANIMATION_SLOTS];
+static uint16_t last_frame;
+static uint32_t render_cycles;
+
+void animation_init(void)
+{
+    memset(slots, 0, sizeof(slots));
+
+    //SysTick runs free from the core clock as a cycle counter. It may
+    //already be counting for the boot timeline.
+    if (!(SysTick->CTRL & SysTick_CTRL_ENABLE_Msk))
+    {
+        SysTick->LOAD = SYSTICK_MAX;
+        SysTick->VAL = 0;
+        SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+    }
+
+    last_frame = leds_get_frame_count();
+}
+
+/**
+ * Loads a keyframe into a slot
+ */
+static void animation_load(AnimationSlot *slot, uint8_t keyframe)
+{
+    slot->keyframe = keyframe;
+    slot->step = 0;
+    slot->frames = slot->animation->keyframes[keyframe].frames;
+}
+
+/**
+ * Moves a slot to the keyframe after its current one
+ *
+ * Returns false if a non-looping animation has ended
+ */
+static bool animation_next_keyframe(AnimationSlot *slot)
+{
+    uint8_t next = slot->keyframe + 1;
+    if (next >= slot->animation->count)
+    {
+        if (!slot->animation->loop)
+            return false;
+        next = 0;
+    }
+    //keyframes lasting no frames compose the picture with the next one
+    if (slot->animation->keyframes[slot->keyframe].frames)
+        slot->group = next;
+    animation_load(slot, next);
+    return true;
+}
+
+/**
+ * Moves a slot to its next repetition or keyframe
+ *
+ * Returns false if a non-looping animation has ended
+ */
+static bool animation_advance(AnimationSlot *slot)
+{
+    const AnimationKeyframe *k = &slot->animation->keyframes[slot->keyframe];
+
+    if (slot->step + 1 < k->repeat)
+    {
+        slot->step++;
+        slot->frames = k->frames;
+        return true;
+    }
+    return animation_next_keyframe(slot);
+}
+
+/**
+ * Adds a keyframe's span at some repetition to an image
+ */
+static void animation_draw(LEDImage *image, const AnimationKeyframe *k,
+        uint8_t origin, uint8_t step)
+{
+    LEDBitmap span;
+    int16_t level = k->level + step * k->level_step;
+    int16_t count = k->count + step * k->count_step;
+    int16_t position = origin + k->first + step * k->first_step;
+
+    if (count <= 0 || level <= 0)
+        return;
+    if (level > 3)
+        level = 3;
+    if (count > LEDS_MINUTE_COUNT)
+        count = LEDS_MINUTE_COUNT;
+    while (position < 0)
+        position += LEDS_MINUTE_COUNT;
+    while (position >= LEDS_MINUTE_COUNT)
+        position -= LEDS_MINUTE_COUNT;
+
+    leds_bitmap_clear(&span);
+    leds_bitmap_set_minutes(&span, position, count);
+    leds_image_set(image, &span, level);
+}
+
+/**
+ * Renders the current picture of a slot into its layer
+ *
+ * Keyframes composed with the current one are drawn at its repetition so
+ * that they move along with it.
+ */
+static void animation_render(AnimationSlot *slot)
+{
+    LEDImage image;
+    const AnimationKeyframe *keyframes = slot->animation->keyframes;
+
+    if (slot->animation->dims)
+    {
+        const AnimationKeyframe *k = &keyframes[slot->keyframe];
+        int16_t level = k->level + slot->step * k->level_step;
+        layers_set_limit(level < 0 ? 0 : level > 3 ? 3 : level);
+        return;
+    }
+
+    leds_image_clear(&image);
+    for (uint8_t i = slot->group; i <= slot->keyframe; i++)
+    {
+        animation_draw(&image, &keyframes[i], slot->origin, slot->step);
+    }
+    layers_set_image(slot->layer, &image);
+}
+
+/**
+ * Undoes what a slot's animation has rendered
+ */
+static void animation_clear(AnimationSlot *slot)
+{
+    LEDImage image;
+
+    if (slot->animation->dims)
+    {
+        layers_set_limit(3);
+        return;
+    }
+    leds_image_clear(&image);
+    layers_set_image(slot->layer, &image);
+}
+
+/**
+ * Finds the slot rendering into a layer
+ */
+static AnimationSlot *animation_find(uint8_t layer)
+{
+    for (uint8_t i = 0; i < ANIMATION_SLOTS; i++)
+    {
+        if (slots[i].animation && slots[i].layer == layer)
+            return &slots[i];
+    }
+    return NULL;
+}
+
+void animation_play(uint8_t layer, const Animation *animation, uint8_t origin)
+{
+    AnimationSlot *slot = animation_find(layer);
+    for (uint8_t i = 0; !slot && i < ANIMATION_SLOTS; i++)
+    {
+        if (!slots[i].animation)
+            slot = &slots[i];
+    }
+    if (!slot)
+        return;
+
+    //the new animation only overwrites what it renders itself, the layer
+    //or the limit
+    if (slot->animation && slot->animation->dims != animation->dims)
+        animation_clear(slot);
+
+    slot->animation = animation;
+    slot->layer = layer;
+    slot->origin = origin;
+    slot->group = 0;
+    animation_load(slot, 0);
+
+    //skip ahead to the first keyframe which is shown
+    while (!slot->frames && animation_next_keyframe(slot)) { }
+    animation_render(slot);
+}
+
+void animation_stop(uint8_t layer)
+{
+    AnimationSlot *slot = animation_find(layer);
+    if (!slot)
+        return;
+
+    animation_clear(slot);
+    slot->animation = NULL;
+}
+
+bool animation_is_playing(uint8_t layer)
+{
+    return animation_find(layer) != NULL;
+}
+
+void animation_update(void)
+{
+    uint16_t frame = leds_get_frame_count();
+    uint16_t elapsed = frame - last_frame;
+    uint32_t start;
+    bool rendered = false;
+
+    if (!elapsed)
+        return;
+    last_frame = frame;
+
+    start = SysTick->VAL;
+    for (uint8_t i = 0; i < ANIMATION_SLOTS; i++)
+    {
+        AnimationSlot *slot = &slots[i];
+        bool changed = false;
+
+        if (!slot->animation)
+            continue;
+
+        for (uint16_t e = elapsed; e; )
+        {
+            if (slot->frames > e)
+            {
+                slot->frames -= e;
+                break;
+            }
+            e -= slot->frames;
+            changed = true;
+            if (!animation_advance(slot))
+            {
+                animation_stop(slot->layer);
+                break;
+            }
+            while (!slot->frames && animation_next_keyframe(slot)) { }
+        }
+
+        if (changed && slot->animation)
+        {
+            animation_render(slot);
+            rendered = true;
+        }
+    }
+
+    //SysTick counts down
+    if (rendered)
+        render_cycles = (start - SysTick->VAL) & SYSTICK_MAX;
+}
+
+uint16_t animation_get_frames_until_change(void)
+{
+    uint16_t elapsed = leds_get_frame_count() - last_frame;
+    uint16_t frames = 0xFFFF;
+
+    for (uint8_t i = 0; i < ANIMATION_SLOTS; i++)
+    {
+        if (!slots[i].animation)
+            continue;
+        if (slots[i].frames <= elapsed)
+            return 0;
+        if (slots[i].frames - elapsed < frames)
+            frames = slots[i].frames - elapsed;
+    }
+    return frames;
+}
+
+uint32_t animation_get_render_cycles(void)
+{
+    return render_cycles;
+}
@@ -0,0 +1,88 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#include "boot.h"
+
+#include "stm32l0xx.h"
+#include "system_stm32l0xx.h"
+#include "osc.h"
+
+#define SYSTICK_MAX 0xFFFFFF
+#define BOOT_ALL_STAGES ((1 << BOOT_STAGE_COUNT) - 1)
+
+static uint32_t stage_us[BOOT_STAGE_COUNT];
+static uint8_t reached;
+static uint32_t elapsed_us;
+static uint32_t last_val;
+static uint32_t last_hz;
+
+/**
+ * Adds the cycles since the last update to the elapsed time, at the clock
+ * they ran at. Interrupts must be disabled.
+ */
+static void boot_update(void)
+{
+    uint32_t val = SysTick->VAL;
+
+    //SysTick counts down
+    elapsed_us += (uint64_t)((last_val - val) & SYSTICK_MAX) * 1000000 / last_hz;
+    last_val = val;
+    last_hz = SystemCoreClock;
+}
+
+/**
+ * Oscillator change callback: the cycles so far ran at the old clock
+ */
+static void boot_clock_changed(void)
+{
+    boot_tick();
+}
+
+void boot_start(void)
+{
+    //SysTick runs free from the core clock as a cycle counter (see
+    //animation_init, which leaves it running)
+    SysTick->LOAD = SYSTICK_MAX;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+
+    last_val = SysTick->VAL;
+    last_hz = SystemCoreClock;
+    osc_add_callback(&boot_clock_changed);
+}
+
+void boot_mark(BootStage stage)
+{
+    uint32_t primask;
+
+    if (reached & (1 << stage))
+        return;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    boot_update();
+    stage_us[stage] = elapsed_us ? elapsed_us : 1;
+    reached |= 1 << stage;
+    __set_PRIMASK(primask);
+}
+
+void boot_tick(void)
+{
+    uint32_t primask;
+
+    if (reached == BOOT_ALL_STAGES)
+        return;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    boot_update();
+    __set_PRIMASK(primask);
+}
+
+uint32_t boot_get_time(BootStage stage)
+{
+    return stage_us[stage];
+}
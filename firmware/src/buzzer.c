@@ -11,6 +11,7 @@
 #include "osc.h"
 
 static volatile uint16_t counter = 0;
+static volatile uint32_t on_time = 0;
 
 static void buzzer_set_frequency(void)
 {
@@ -58,8 +59,14 @@ void buzzer_trigger_beep(void)
     TIM22->CR1 = TIM_CR1_CEN;
 }
 
+uint32_t buzzer_get_on_time(void)
+{
+    return on_time;
+}
+
 void __attribute__ ((interrupt ("IRQ"))) TIM22_IRQHandler()
 {
+    on_time++;
     counter--;
     if (!counter)
     {
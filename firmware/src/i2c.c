@@ -10,6 +10,12 @@
 #include "system_stm32l0xx.h"
 #include "osc.h"
 
+//The timing below needs at least a 1MHz clock for 100KHz (or close to it).
+//Slower clocks just slow the bus down.
+#define I2C_MIN_CLOCK_HZ 1000000
+
+static OscRequirement i2c_clock;
+
 static void i2c_set_timing(void)
 {
     uint32_t prescaler = SystemCoreClock / 2000000;
@@ -39,6 +45,7 @@ void i2c_init(void)
     //Set up timing and add a callback to oscillator changes
     i2c_set_timing();
     osc_add_callback(&i2c_set_timing);
+    i2c_clock = osc_add_requirement(I2C_MIN_CLOCK_HZ);
 }
 
 /**
@@ -63,7 +70,7 @@ static bool i2c_wait_ready(uint16_t mask)
     }
 }
 
-bool i2c_write(uint8_t address, uint8_t reg, uint8_t *buffer, uint8_t len)
+static bool i2c_do_write(uint8_t address, uint8_t reg, uint8_t *buffer, uint8_t len)
 {
     I2C1->CR1 = I2C_CR1_PE; //enable peripheral
 
@@ -90,7 +97,7 @@ bool i2c_write(uint8_t address, uint8_t reg, uint8_t *buffer, uint8_t len)
     return true;
 }
 
-bool i2c_read(uint8_t address, uint8_t reg, uint8_t *buffer, uint8_t len)
+static bool i2c_do_read(uint8_t address, uint8_t reg, uint8_t *buffer, uint8_t len)
 {
     I2C1->CR1 = I2C_CR1_PE; //enable peripheral
 
@@ -127,3 +134,33 @@ bool i2c_read(uint8_t address, uint8_t reg, uint8_t *buffer, uint8_t len)
     return true;
 }
 
+
+/**
+ * Holds the I2C clock requirement for a transfer. Clocks can't be switched
+ * from interrupts, so transfers made there run at whatever clock is current.
+ */
+static bool i2c_acquire_clock(void)
+{
+    if (__get_IPSR())
+        return false;
+    osc_acquire(i2c_clock);
+    return true;
+}
+
+bool i2c_write(uint8_t address, uint8_t reg, uint8_t *buffer, uint8_t len)
+{
+    bool acquired = i2c_acquire_clock();
+    bool result = i2c_do_write(address, reg, buffer, len);
+    if (acquired)
+        osc_release(i2c_clock);
+    return result;
+}
+
+bool i2c_read(uint8_t address, uint8_t reg, uint8_t *buffer, uint8_t len)
+{
+    bool acquired = i2c_acquire_clock();
+    bool result = i2c_do_read(address, reg, buffer, len);
+    if (acquired)
+        osc_release(i2c_clock);
+    return result;
+}
@@ -0,0 +1,131 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#include "layers.h"
+
+#include <string.h>
+
+typedef struct {
+    LEDImage image;
+    uint8_t blink;
+    uint8_t blink_count;
+    unsigned enabled:1;
+    unsigned hidden:1;
+} Layer;
+
+static Layer layers[LAYERS_COUNT];
+static uint8_t limit = 3;
+static bool changed;
+
+void layers_init(void)
+{
+    memset(layers, 0, sizeof(layers));
+    limit = 3;
+    changed = true;
+}
+
+static bool layers_bitmap_equal(const LEDBitmap *a, const LEDBitmap *b)
+{
+    return a->minutes == b->minutes && a->hours == b->hours && a->center == b->center;
+}
+
+void layers_set(uint8_t layer, const LEDBitmap *bitmap, uint8_t level)
+{
+    LEDImage image;
+
+    leds_image_clear(&image);
+    leds_image_set(&image, bitmap, level);
+    layers_set_image(layer, &image);
+}
+
+void layers_set_image(uint8_t layer, const LEDImage *image)
+{
+    Layer *l = &layers[layer];
+    bool equal = true;
+
+    for (uint8_t i = 0; i < LEDS_PLANE_COUNT; i++)
+    {
+        equal &= layers_bitmap_equal(&l->image.planes[i], &image->planes[i]);
+    }
+    if (equal)
+        return;
+
+    l->image = *image;
+    if (l->enabled)
+        changed = true;
+}
+
+void layers_set_enabled(uint8_t layer, bool enabled)
+{
+    Layer *l = &layers[layer];
+    if (l->enabled == enabled)
+        return;
+
+    l->enabled = enabled;
+    changed = true;
+}
+
+void layers_set_blink(uint8_t layer, uint8_t ticks)
+{
+    Layer *l = &layers[layer];
+    l->blink = ticks;
+    l->blink_count = ticks;
+    if (l->hidden)
+    {
+        l->hidden = 0;
+        changed |= l->enabled;
+    }
+}
+
+void layers_set_limit(uint8_t level)
+{
+    if (level == limit)
+        return;
+
+    limit = level;
+    changed = true;
+}
+
+void layers_tick(void)
+{
+    for (uint8_t i = 0; i < LAYERS_COUNT; i++)
+    {
+        Layer *l = &layers[i];
+        if (!l->blink || --l->blink_count)
+            continue;
+
+        l->blink_count = l->blink;
+        l->hidden = !l->hidden;
+        changed |= l->enabled;
+    }
+}
+
+void layers_update(void)
+{
+    if (!changed)
+        return;
+    changed = false;
+
+    leds_clear();
+    for (uint8_t i = 0; i < LAYERS_COUNT; i++)
+    {
+        Layer *l = &layers[i];
+        if (!l->enabled || l->hidden)
+            continue;
+
+        if (limit < 3)
+        {
+            LEDImage image = l->image;
+            leds_image_limit(&image, limit);
+            leds_draw_image(&image);
+        }
+        else
+        {
+            leds_draw_image(&l->image);
+        }
+    }
+    leds_commit();
+}
@@ -7,7 +7,10 @@
 #include "leds.h"
 
 #include "stm32l0xx.h"
+#include "system_stm32l0xx.h"
+#include "osc.h"
 
+#include <stdbool.h>
 #include <string.h>
 
 #define MUX_PIN_MASK (GPIO_ODR_OD3 | GPIO_ODR_OD4 | GPIO_ODR_OD5 | GPIO_ODR_OD6)
@@ -27,22 +30,138 @@ typedef union {
 
 typedef struct {
     LEDSegment segments[16];
+} LEDPlane;
+
+/**
+ * Hardware ordered display, converted from the logical bitmaps once per
+ * commit. Plane n is shown for 2^n time units, so a level 0-3 LED is lit for
+ * 0-3 units out of every 3 units its segment is selected (binary code
+ * modulation).
+ */
+typedef struct {
+    LEDPlane planes[LEDS_PLANE_COUNT];
 } LEDDisplay;
 
 typedef struct {
-    unsigned current_level:2;
-    unsigned current_segment:4;
+    uint8_t current_step;
 } LEDStatus;
 
-static LEDDisplay edit_display;
-static LEDDisplay draw_display;
+//Default refresh: ~60 complete refreshes per second...any lower and there is a
+//noticeable flicker.
+#define LED_DEFAULT_REFRESH_HZ 60
+#define LED_DEFAULT_LEVELS 4
+
+//Shortest time a step may be lit, so the ISR is done before the next update
+#define LED_MIN_LIT_TICKS 64
+
+//Fewest core cycles per BCM time unit that leave the core time for anything
+//besides servicing the display
+#define LED_MIN_UNIT_CYCLES_INTERRUPT 256
+#define LED_MIN_UNIT_CYCLES_DMA (4 * DMA_ENABLE_TICKS)
+
+/**
+ * Precomputed frame
+ *
+ * Each step holds the GPIOB->BSRR word which disables the mux and selects a
+ * segment along with the GPIOA->BSRR word for its LEDs, with the odd segment
+ * wiring reversal already applied. Interrupt mode shows one step per segment
+ * and plane for the period stored with the step, skipping steps with no LEDs
+ * lit. DMA mode runs every step for one time unit and repeats the higher plane
+ * steps to match their weight.
+ */
+#define FRAME_STEPS_PER_SEGMENT ((1 << LEDS_PLANE_COUNT) - 1)
+#define FRAME_MAX_STEPS (16 * FRAME_STEPS_PER_SEGMENT)
+
+typedef struct {
+    uint32_t mux[FRAME_MAX_STEPS];
+    uint32_t leds[FRAME_MAX_STEPS];
+    uint32_t enable[FRAME_MAX_STEPS];
+    uint16_t periods[FRAME_MAX_STEPS];
+    uint8_t count;
+} LEDFrame;
+
+/**
+ * DMA mode
+ *
+ * TIM21 has no DMA requests on the STM32L052, so DMA mode runs from TIM2
+ * instead. Each timer period is one BCM time unit and displays one frame
+ * step:
+ *
+ * - Update: DMA1 channel 2 writes the mux step to GPIOB->BSRR, which disables
+ *   the 74HC154 and selects the segment.
+ * - CC1: DMA1 channel 5 writes the LED step to GPIOA->BSRR.
+ * - CC2: DMA1 channel 3 writes a constant to GPIOB->BSRR, enabling the mux.
+ * - CC3: DMA1 channel 1 writes a constant to GPIOB->BSRR, disabling the mux
+ *   again to set the global brightness. At full brightness CC3 never matches.
+ *
+ * Channel 5 completing a frame raises the only interrupt, which counts frames
+ * and swaps in a pending frame.
+ */
+#define DMA_LED_TICKS 8
+#define DMA_ENABLE_TICKS 16
+#define DMA_CSELR_TIM2 8
+
+/**
+ * Frames are double buffered. leds_commit builds into the back frame and
+ * requests a swap, which the display performs at the next frame boundary so
+ * that a frame is never shown half old and half new.
+ */
+static LEDFrame frames[2];
+static LEDFrame *volatile front = &frames[0];
+static LEDFrame *volatile back = &frames[1];
+static volatile bool swap_pending;
+
+#define MINUTE_MASK ((1ULL << LEDS_MINUTE_COUNT) - 1)
+#define HOUR_MASK ((1 << LEDS_HOUR_COUNT) - 1)
+
+static LEDImage edit_image;
+static LEDImage commit_image;
+static volatile uint16_t frame_count;
+static volatile bool first_frame;
+static bool dirty;
 static LEDStatus status;
+static LEDMode mode;
+static uint16_t refresh_hz = LED_DEFAULT_REFRESH_HZ;
+static uint8_t plane_count = LEDS_PLANE_COUNT;
+static uint16_t unit_ticks;
+static uint8_t brightness = 100;
+static uint16_t lit_ticks;
+static OscRequirement display_clock;
+static uint16_t lit_load;
+static uint32_t load_scale; //65536 / the frame's total plane weight
+
+/**
+ * Display timing for a core clock and the display settings
+ */
+typedef struct {
+    uint32_t core_hz;
+    uint16_t refresh_hz;
+    uint8_t planes;
+    uint8_t brightness;
+    uint16_t prescaler;
+    uint16_t unit_ticks;
+    uint16_t lit_ticks;
+} LEDTiming;
+
+//While awake, the core switches between the rendering and the idle clock
+//every second (see power_set_idle), and computing the timing takes several
+//software divisions. The timings for the last clocks are kept instead.
+#define LED_TIMING_CACHE_SIZE 2
+static LEDTiming timing_cache[LED_TIMING_CACHE_SIZE];
+static uint8_t timing_cache_next;
+static const uint32_t dma_mux_enable = GPIO_BSRR_BR_7;
+static const uint32_t dma_mux_disable = GPIO_BSRR_BS_7;
 
 void leds_init(void)
 {
+    //The clock needed depends on the refresh rate, set with it below
+    display_clock = osc_add_requirement(0);
+
     //Enable clocks
     RCC->IOPENR |= RCC_IOPENR_IOPAEN | RCC_IOPENR_IOPBEN;
     RCC->APB2ENR |= RCC_APB2ENR_TIM21EN;
+    RCC->APB1ENR |= RCC_APB1ENR_TIM2EN;
+    RCC->AHBENR |= RCC_AHBENR_DMAEN;
 
     //Set all LED control pins to output
     GPIOA->MODER &= ~(GPIO_MODER_MODE0 | GPIO_MODER_MODE1 | GPIO_MODER_MODE2 |
@@ -58,22 +177,114 @@ void leds_init(void)
     leds_disable();
 
     //Prepare the timer for interrupt
-    TIM21->ARR = 546; //240 complete refreshes per second...any lower and there is a noticeable flicker. Weird.
     TIM21->DIER = TIM_DIER_UIE;
     NVIC_EnableIRQ(TIM21_IRQn);
 
+    //Prepare the DMA timer and channels, mem->periph 32-bit words
+    TIM2->CCR1 = DMA_LED_TICKS;
+    TIM2->CCR2 = DMA_ENABLE_TICKS;
+    TIM2->DIER = TIM_DIER_UDE | TIM_DIER_CC1DE | TIM_DIER_CC2DE | TIM_DIER_CC3DE;
+    DMA1_CSELR->CSELR &= ~(DMA_CSELR_C1S | DMA_CSELR_C2S | DMA_CSELR_C3S | DMA_CSELR_C5S);
+    DMA1_CSELR->CSELR |= (DMA_CSELR_TIM2 << DMA_CSELR_C1S_Pos) |
+        (DMA_CSELR_TIM2 << DMA_CSELR_C2S_Pos) |
+        (DMA_CSELR_TIM2 << DMA_CSELR_C3S_Pos) |
+        (DMA_CSELR_TIM2 << DMA_CSELR_C5S_Pos);
+    DMA1_Channel1->CPAR = (uint32_t)&GPIOB->BSRR;
+    DMA1_Channel2->CPAR = (uint32_t)&GPIOB->BSRR;
+    DMA1_Channel3->CPAR = (uint32_t)&GPIOB->BSRR;
+    DMA1_Channel5->CPAR = (uint32_t)&GPIOA->BSRR;
+    NVIC_EnableIRQ(DMA1_Channel4_5_6_7_IRQn);
+
     leds_clear();
-    leds_commit();
+
+    //Set up timing and add a callback to oscillator changes
+    leds_set_refresh(LED_DEFAULT_REFRESH_HZ, LED_DEFAULT_LEVELS);
+    osc_add_callback(&leds_set_timing);
 }
 
-void leds_enable(void)
+/**
+ * Returns whether the display is currently being multiplexed
+ */
+static bool leds_running(void)
 {
-    TIM21->CR1 = TIM_CR1_CEN;
+    return (TIM21->CR1 | TIM2->CR1) & TIM_CR1_CEN;
 }
 
-void leds_disable(void)
+/**
+ * Exchanges the front and back frames. Must only be called at a frame boundary
+ * or while the display is stopped.
+ */
+static void leds_swap(void)
+{
+    LEDFrame *temp = front;
+    front = back;
+    back = temp;
+    swap_pending = false;
+}
+
+/**
+ * Starts TIM2 and the DMA channels from the first frame step
+ */
+static void leds_dma_start(void)
+{
+    const uint32_t ccr = DMA_CCR_MSIZE_1 | DMA_CCR_PSIZE_1 | DMA_CCR_CIRC |
+        DMA_CCR_DIR | DMA_CCR_EN;
+
+    if (swap_pending)
+        leds_swap();
+
+    DMA1_Channel2->CMAR = (uint32_t)front->mux;
+    DMA1_Channel2->CNDTR = front->count;
+    DMA1_Channel2->CCR = ccr | DMA_CCR_MINC;
+    DMA1_Channel5->CMAR = (uint32_t)front->leds;
+    DMA1_Channel5->CNDTR = front->count;
+    DMA1_Channel5->CCR = ccr | DMA_CCR_MINC | DMA_CCR_TCIE;
+    DMA1_Channel3->CMAR = (uint32_t)&dma_mux_enable;
+    DMA1_Channel3->CNDTR = 1;
+    DMA1_Channel3->CCR = ccr;
+    DMA1_Channel1->CMAR = (uint32_t)&dma_mux_disable;
+    DMA1_Channel1->CNDTR = 1;
+    DMA1_Channel1->CCR = ccr;
+
+    //start right before an update so the mux step is written first
+    TIM2->SR = 0;
+    TIM2->CNT = TIM2->ARR;
+    TIM2->CR1 = TIM_CR1_CEN;
+}
+
+/**
+ * Starts multiplexing in the current mode
+ */
+static void leds_start(void)
+{
+    if (mode == LEDS_MODE_DMA)
+    {
+        leds_dma_start();
+    }
+    else
+    {
+        //start right before an update so the first step is output first
+        TIM21->SR = 0;
+        TIM21->CNT = TIM21->ARR;
+        TIM21->CR1 = TIM_CR1_CEN;
+    }
+}
+
+/**
+ * Stops multiplexing and turns off the mux
+ */
+static void leds_stop(void)
 {
     TIM21->CR1 = 0;
+    TIM2->CR1 = 0;
+    DMA1_Channel1->CCR = 0;
+    DMA1_Channel2->CCR = 0;
+    DMA1_Channel3->CCR = 0;
+    DMA1_Channel5->CCR = 0;
+
+    //the next start outputs the front frame from its first step, which may
+    //be a different frame by then
+    status.current_step = 0;
 
     //Disable the mux
     GPIOB->BSRR = GPIO_BSRR_BS_7;
@@ -88,43 +299,214 @@ void leds_disable(void)
     //disabled.
     GPIOA->BSRR = GPIO_BSRR_BS_5; }
 
+void __attribute__((weak)) hook_leds_first_frame(void) { }
+
+void leds_enable(void)
+{
+    //the clock is switched before starting so the timing is already updated
+    if (!leds_running())
+    {
+        osc_acquire(display_clock);
+        first_frame = true;
+        leds_start();
+    }
+}
+
+void leds_disable(void)
+{
+    bool running = leds_running();
+
+    leds_stop();
+    if (running)
+        osc_release(display_clock);
+}
+
 void leds_clear(void)
 {
-    memset(&edit_display, 0x00, sizeof(LEDDisplay));
+    leds_image_clear(&edit_image);
+    dirty = true;
 }
 
 void leds_set_minute(uint8_t led, uint8_t level)
 {
-    uint8_t segment = led / 5;
-    uint8_t position = led % 5;
-    if (level)
+    LEDBitmap bitmap = { 1ULL << led, 0, 0 };
+    leds_draw_bitmap(&bitmap, level);
+}
+
+void leds_set_hour(uint8_t led, uint8_t level)
+{
+    LEDBitmap bitmap = { 0, 1 << led, 0 };
+    leds_draw_bitmap(&bitmap, level);
+}
+
+void leds_set_center(uint8_t red, uint8_t green, uint8_t blue)
+{
+    LEDBitmap bitmap = { 0, 0, LEDS_CENTER_RED };
+    leds_draw_bitmap(&bitmap, red);
+    bitmap.center = LEDS_CENTER_GREEN;
+    leds_draw_bitmap(&bitmap, green);
+}
+
+void leds_draw_bitmap(const LEDBitmap *bitmap, uint8_t level)
+{
+    leds_image_set(&edit_image, bitmap, level);
+    dirty = true;
+}
+
+void leds_draw_image(const LEDImage *image)
+{
+    LEDBitmap cover = image->planes[0];
+    for (uint8_t i = 1; i < LEDS_PLANE_COUNT; i++)
     {
-        edit_display.segments[segment].segment |= 1 << position;
+        leds_bitmap_or(&cover, &image->planes[i]);
     }
-    else
+
+    //lit LEDs of the image replace what is under them
+    for (uint8_t i = 0; i < LEDS_PLANE_COUNT; i++)
     {
-        edit_display.segments[segment].segment &= ~(1 << position);
+        LEDBitmap *plane = &edit_image.planes[i];
+        plane->minutes = (plane->minutes & ~cover.minutes) | image->planes[i].minutes;
+        plane->hours = (plane->hours & ~cover.hours) | image->planes[i].hours;
+        plane->center = (plane->center & ~cover.center) | image->planes[i].center;
     }
+    dirty = true;
 }
 
-void leds_set_hour(uint8_t led, uint8_t level)
+uint16_t leds_get_frame_count(void)
 {
-    edit_display.segments[led].hour = level;
+    return frame_count;
 }
 
-void leds_set_center(uint8_t red, uint8_t green, uint8_t blue)
+void leds_image_clear(LEDImage *image)
 {
-    // There is some rework here. I screwed up the LED footprint on the board,
-    // so it is backwards in the vertical direction. To fix this, the anode and
-    // blue terminal are shorted. Only red and green are connected to the
-    // 74HC154 and they are now reversed.
-    edit_display.segments[13].zero = red;
-    edit_display.segments[12].zero = green;
+    memset(image, 0x00, sizeof(LEDImage));
 }
 
-void leds_commit(void)
+void leds_image_set(LEDImage *image, const LEDBitmap *bitmap, uint8_t level)
+{
+    for (uint8_t i = 0; i < LEDS_PLANE_COUNT; i++)
+    {
+        LEDBitmap *plane = &image->planes[i];
+        if (level & (1 << i))
+        {
+            leds_bitmap_or(plane, bitmap);
+        }
+        else
+        {
+            plane->minutes &= ~bitmap->minutes;
+            plane->hours &= ~bitmap->hours;
+            plane->center &= ~bitmap->center;
+        }
+    }
+}
+
+void leds_image_limit(LEDImage *image, uint8_t level)
 {
-    memcpy(&draw_display, &edit_display, sizeof(draw_display));
+    LEDBitmap above = { 0, 0, 0 };
+    LEDBitmap equal = { MINUTE_MASK, HOUR_MASK, LEDS_CENTER_RED | LEDS_CENTER_GREEN };
+
+    if (level >= (1 << LEDS_PLANE_COUNT))
+        return;
+
+    //compares the level of every LED with the limit at once, one bit plane
+    //at a time from the most significant
+    for (int8_t i = LEDS_PLANE_COUNT - 1; i >= 0; i--)
+    {
+        const LEDBitmap *plane = &image->planes[i];
+        if (level & (1 << i))
+        {
+            leds_bitmap_mask(&equal, plane);
+        }
+        else
+        {
+            above.minutes |= equal.minutes & plane->minutes;
+            above.hours |= equal.hours & plane->hours;
+            above.center |= equal.center & plane->center;
+            equal.minutes &= ~plane->minutes;
+            equal.hours &= ~plane->hours;
+            equal.center &= ~plane->center;
+        }
+    }
+    leds_image_set(image, &above, level);
+}
+
+void leds_bitmap_clear(LEDBitmap *bitmap)
+{
+    memset(bitmap, 0x00, sizeof(LEDBitmap));
+}
+
+void leds_bitmap_set_minutes(LEDBitmap *bitmap, uint8_t first, uint8_t count)
+{
+    LEDBitmap range = { MINUTE_MASK, 0, 0 };
+    if (count < LEDS_MINUTE_COUNT)
+    {
+        range.minutes = (1ULL << count) - 1;
+        leds_bitmap_rotate_minutes(&range, first);
+    }
+    bitmap->minutes |= range.minutes;
+}
+
+void leds_bitmap_rotate_minutes(LEDBitmap *bitmap, uint8_t count)
+{
+    uint64_t minutes = bitmap->minutes;
+    if (!count)
+        return;
+    bitmap->minutes = ((minutes << count) | (minutes >> (LEDS_MINUTE_COUNT - count))) & MINUTE_MASK;
+}
+
+void leds_bitmap_rotate_hours(LEDBitmap *bitmap, uint8_t count)
+{
+    uint16_t hours = bitmap->hours;
+    if (!count)
+        return;
+    bitmap->hours = ((hours << count) | (hours >> (LEDS_HOUR_COUNT - count))) & HOUR_MASK;
+}
+
+void leds_bitmap_mask(LEDBitmap *bitmap, const LEDBitmap *mask)
+{
+    bitmap->minutes &= mask->minutes;
+    bitmap->hours &= mask->hours;
+    bitmap->center &= mask->center;
+}
+
+void leds_bitmap_or(LEDBitmap *bitmap, const LEDBitmap *other)
+{
+    bitmap->minutes |= other->minutes;
+    bitmap->hours |= other->hours;
+    bitmap->center |= other->center;
+}
+
+/**
+ * Converts a logical image into the hardware ordered display
+ *
+ * display: Display to fill
+ * image: Image to convert
+ */
+static void leds_bitmap_to_display(LEDDisplay *display, const LEDImage *image)
+{
+    for (uint8_t i = 0; i < LEDS_PLANE_COUNT; i++)
+    {
+        LEDSegment *segments = display->planes[i].segments;
+        uint64_t minutes = image->planes[i].minutes;
+        uint16_t hours = image->planes[i].hours;
+
+        //segments 0-11 each hold 5 minute LEDs and 1 hour LED
+        for (uint8_t segment = 0; segment < LEDS_HOUR_COUNT; segment++)
+        {
+            segments[segment].segment = (minutes & 0x1F) | ((hours & 0x1) << 5);
+            minutes >>= 5;
+            hours >>= 1;
+        }
+
+        // There is some rework here. I screwed up the LED footprint on the board,
+        // so it is backwards in the vertical direction. To fix this, the anode and
+        // blue terminal are shorted. Only red and green are connected to the
+        // 74HC154 and they are now reversed.
+        segments[12].segment = !!(image->planes[i].center & LEDS_CENTER_GREEN);
+        segments[13].segment = !!(image->planes[i].center & LEDS_CENTER_RED);
+        segments[14].segment = 0;
+        segments[15].segment = 0;
+    }
 }
 
 /**
@@ -139,36 +521,376 @@ static uint8_t reverse_byte(uint8_t b) {
    return b;
 }
 
-void TIM21_IRQHandler(void)
+/**
+ * Determines the PORTA value for a segment of a display plane
+ *
+ * display: Display to read
+ * plane: Bit plane
+ * segment: Segment (0-15)
+ */
+static uint8_t leds_segment_value(const LEDDisplay *display, uint8_t plane, uint8_t segment)
 {
-    //determine the next PORTA value
-    uint8_t segmentValue = draw_display
-        .segments[status.current_segment]
-        .segment;
+    uint8_t segmentValue = display->planes[plane].segments[segment].segment;
 
     //to ease routing, odd segments are wired backwards for the minutes
-    if ((status.current_segment % 2) && status.current_segment < 12)
+    if ((segment % 2) && segment < 12)
     {
         segmentValue = reverse_byte(segmentValue) >> 3 | (segmentValue & 0x20);
     }
 
+    return segmentValue;
+}
+
+/**
+ * Builds a frame in the format used by the current mode
+ *
+ * frame: Frame to build
+ * display: Display to build the frame from
+ */
+static void leds_build_frame(LEDFrame *frame, const LEDDisplay *display)
+{
+    //with fewer levels only the most significant planes are shown
+    uint8_t first_plane = LEDS_PLANE_COUNT - plane_count;
+    uint32_t blank_ticks = 0;
+    uint8_t step = 0;
+    for (uint8_t segment = 0; segment < 16; segment++)
+    {
+        uint32_t mux = ((segment << 3) & MUX_PIN_MASK) |
+            ((~(segment << 3) & MUX_PIN_MASK) << 16) |
+            GPIO_BSRR_BS_7;
+        for (uint8_t plane = first_plane; plane < LEDS_PLANE_COUNT; plane++)
+        {
+            uint8_t value = leds_segment_value(display, plane, segment);
+            uint32_t leds = (value & LED_PIN_MASK) | ((~value & LED_PIN_MASK) << 16);
+            uint8_t weight = 1 << (plane - first_plane);
+            //DMA steps are one time unit each, interrupt steps last the
+            //whole weight
+            uint8_t repeat = mode == LEDS_MODE_DMA ? weight : 1;
+            uint8_t units = mode == LEDS_MODE_DMA ? 1 : weight;
+
+            //in interrupt mode, steps with nothing lit are folded into a single
+            //blank step at the end of the frame
+            if (!value && mode == LEDS_MODE_INTERRUPT)
+            {
+                blank_ticks += (uint32_t)unit_ticks * weight;
+                continue;
+            }
+
+            //lit steps are shortened for the global brightness and the rest
+            //of their time is spent blank
+            for (uint8_t i = 0; i < repeat; i++, step++)
+            {
+                frame->mux[step] = mux;
+                frame->leds[step] = leds;
+                frame->enable[step] = GPIO_BSRR_BR_7;
+                frame->periods[step] = lit_ticks * units - 1;
+            }
+            if (mode == LEDS_MODE_INTERRUPT)
+                blank_ticks += (uint32_t)(unit_ticks - lit_ticks) * weight;
+        }
+    }
+
+    //the blank step keeps the frame length (and so the brightness of every
+    //step) unchanged. The mux stays disabled with the blue pin high.
+    if (blank_ticks)
+    {
+        frame->mux[step] = GPIO_BSRR_BS_7;
+        frame->leds[step] = GPIO_BSRR_BS_5 | ((LED_PIN_MASK & ~GPIO_ODR_OD5) << 16);
+        frame->enable[step] = 0;
+        frame->periods[step] = blank_ticks - 1;
+        step++;
+    }
+
+    frame->count = step;
+}
+
+/**
+ * Counts the set bits of a word
+ */
+static uint8_t leds_count_bits(uint64_t bits)
+{
+    uint8_t count = 0;
+    for (; bits; bits &= bits - 1)
+        count++;
+    return count;
+}
+
+/**
+ * Estimates the committed image's load as hundredths of fully lit LEDs, from
+ * the shown planes and the brightness
+ */
+static uint16_t leds_estimate_load(void)
+{
+    uint8_t first_plane = LEDS_PLANE_COUNT - plane_count;
+    uint32_t weighted = 0;
+
+    for (uint8_t p = first_plane; p < LEDS_PLANE_COUNT; p++)
+    {
+        const LEDBitmap *plane = &commit_image.planes[p];
+        uint8_t count = leds_count_bits(plane->minutes) +
+            leds_count_bits(plane->hours) + leds_count_bits(plane->center);
+        weighted += (uint32_t)count << (p - first_plane);
+    }
+    return (weighted * brightness * load_scale) >> 16;
+}
+
+/**
+ * Builds the back frame from the committed display and hands it to the display
+ */
+static void leds_present(void)
+{
+    LEDDisplay display;
+
+    lit_load = leds_estimate_load();
+
+    //the display never swaps to a frame which isn't pending, so the back frame
+    //is ours until the swap is requested again
+    swap_pending = false;
+    leds_bitmap_to_display(&display, &commit_image);
+    leds_build_frame(back, &display);
+
+    if (!leds_running())
+    {
+        leds_swap();
+    }
+    else
+    {
+        swap_pending = true;
+    }
+}
+
+void leds_commit(void)
+{
+    //redrawing the same content is common, so only a real change costs a
+    //frame build
+    if (!dirty)
+        return;
+    dirty = false;
+    if (!memcmp(&edit_image, &commit_image, sizeof(LEDImage)))
+        return;
+    memcpy(&commit_image, &edit_image, sizeof(LEDImage));
+    leds_present();
+}
+
+/**
+ * Updates the display clock requirement for the current refresh rate, levels
+ * and mode
+ */
+static void leds_update_clock(void)
+{
+    uint8_t range = leds_get_min_msi_range(refresh_hz, 1 << plane_count);
+
+    osc_set_requirement(display_clock, range > OSC_MSI_MAX_RANGE ?
+            OSC_HSI16_FREQUENCY : OSC_MSI_FREQUENCY(range));
+}
+
+void leds_set_mode(LEDMode next)
+{
+    bool running = leds_running();
+
+    if (running)
+        leds_stop();
+    mode = next;
+    leds_update_clock();
+    leds_present();
+    if (running)
+        leds_start();
+}
+
+/**
+ * Returns the number of BCM time units in a frame
+ */
+static uint16_t leds_frame_units(uint8_t planes)
+{
+    return 16 * ((1 << planes) - 1);
+}
+
+/**
+ * Converts a level count into the number of planes needed to show it
+ */
+static uint8_t leds_levels_to_planes(uint8_t levels)
+{
+    return levels > 2 ? LEDS_PLANE_COUNT : 1;
+}
+
+/**
+ * Computes the display timing for the current core clock and settings
+ *
+ * timing: Timing to fill out
+ */
+static void leds_compute_timing(LEDTiming *timing)
+{
+    //prescale so that even a whole frame fits in a 16-bit period
+    uint32_t prescaler = (SystemCoreClock / refresh_hz) >> 16;
+    uint32_t tick_hz = SystemCoreClock / (prescaler + 1);
+    uint32_t unit = tick_hz / ((uint32_t)refresh_hz * leds_frame_units(plane_count));
+
+    //the lit portion of each time unit is set by the global brightness
+    uint32_t lit = unit * brightness / 100;
+    if (lit < LED_MIN_LIT_TICKS)
+        lit = LED_MIN_LIT_TICKS;
+    if (lit > unit)
+        lit = unit;
+
+    timing->core_hz = SystemCoreClock;
+    timing->refresh_hz = refresh_hz;
+    timing->planes = plane_count;
+    timing->brightness = brightness;
+    timing->prescaler = prescaler;
+    timing->unit_ticks = unit;
+    timing->lit_ticks = lit;
+}
+
+/**
+ * Gets the display timing for the current core clock and settings, from the
+ * cache if it was computed recently
+ */
+static const LEDTiming *leds_get_timing(void)
+{
+    LEDTiming *timing;
+
+    for (uint8_t i = 0; i < LED_TIMING_CACHE_SIZE; i++)
+    {
+        timing = &timing_cache[i];
+        if (timing->core_hz == SystemCoreClock && timing->refresh_hz == refresh_hz &&
+                timing->planes == plane_count && timing->brightness == brightness)
+            return timing;
+    }
+
+    timing = &timing_cache[timing_cache_next];
+    timing_cache_next = (timing_cache_next + 1) & (LED_TIMING_CACHE_SIZE - 1);
+    leds_compute_timing(timing);
+    return timing;
+}
+
+void leds_set_timing(void)
+{
+    const LEDTiming *timing = leds_get_timing();
+
+    unit_ticks = timing->unit_ticks;
+    lit_ticks = timing->lit_ticks;
+    TIM21->PSC = timing->prescaler;
+    TIM2->PSC = timing->prescaler;
+    TIM2->ARR = unit_ticks - 1;
+
+    //in DMA mode the mux is enabled at CC2 and disabled again at CC3
+    if (lit_ticks + DMA_ENABLE_TICKS >= unit_ticks)
+    {
+        TIM2->CCR3 = 0xFFFF;
+    }
+    else
+    {
+        TIM2->CCR3 = DMA_ENABLE_TICKS + lit_ticks;
+    }
+
+    leds_present();
+}
+
+void leds_set_brightness(uint8_t percent)
+{
+    if (percent < 1)
+        percent = 1;
+    if (percent > 100)
+        percent = 100;
+    if (percent == brightness)
+        return;
+
+    brightness = percent;
+    leds_set_timing();
+}
+
+void leds_set_refresh(uint16_t hz, uint8_t levels)
+{
+    refresh_hz = hz ? hz : LED_DEFAULT_REFRESH_HZ;
+    plane_count = leds_levels_to_planes(levels);
+
+    //the load estimate divides by the total weight of the planes by
+    //multiplying with this, rounded up so that whole multiples come out exact
+    load_scale = (0x10000 + (1 << plane_count) - 2) / ((1 << plane_count) - 1);
+
+    leds_set_timing();
+    leds_update_clock();
+}
+
+uint8_t leds_get_min_msi_range(uint16_t hz, uint8_t levels)
+{
+    uint32_t min_cycles = mode == LEDS_MODE_DMA ?
+        LED_MIN_UNIT_CYCLES_DMA : LED_MIN_UNIT_CYCLES_INTERRUPT;
+    uint32_t units_hz = (uint32_t)hz * leds_frame_units(leds_levels_to_planes(levels));
+
+    for (uint8_t range = 0; range <= OSC_MSI_MAX_RANGE; range++)
+    {
+        if (OSC_MSI_FREQUENCY(range) / units_hz >= min_cycles)
+            return range;
+    }
+    return OSC_MSI_MAX_RANGE + 1;
+}
+
+bool leds_is_enabled(void)
+{
+    return leds_running();
+}
+
+uint16_t leds_get_load(void)
+{
+    return lit_load;
+}
+
+void TIM21_IRQHandler(void)
+{
+    if (!status.current_step)
+    {
+        frame_count++;
+        if (swap_pending)
+            leds_swap();
+        if (first_frame)
+        {
+            first_frame = false;
+            hook_leds_first_frame();
+        }
+    }
+
     //turn off mux, set new mux value
-    uint8_t muxValue = status.current_segment << 3;
-    GPIOB->BSRR = (((GPIOB->ODR & MUX_PIN_MASK) ^ muxValue) & muxValue) |
-        ((((GPIOB->ODR & MUX_PIN_MASK) ^ muxValue) & GPIOB->ODR) << 16) |
-        GPIO_BSRR_BS_7;
+    GPIOB->BSRR = front->mux[status.current_step];
 
     //set led value
-    GPIOA->BSRR = (((GPIOA->ODR & LED_PIN_MASK) ^ segmentValue) & segmentValue) |
-        ((((GPIOA->ODR & LED_PIN_MASK) ^ segmentValue) & GPIOA->ODR) << 16);
+    GPIOA->BSRR = front->leds[status.current_step];
+
+    //enable mux, unless this is the blank step
+    GPIOB->BSRR = front->enable[status.current_step];
 
-    //enable mux
-    GPIOB->BSRR = GPIO_BSRR_BR_7;
+    //the counter has already started this period, so the new reload value
+    //determines how long this step lasts
+    TIM21->ARR = front->periods[status.current_step];
 
-    status.current_level++;
-    if (!status.current_level)
-        status.current_segment++;
+    status.current_step++;
+    if (status.current_step >= front->count)
+        status.current_step = 0;
 
     TIM21->SR = 0;
 }
 
+void DMA1_Channel4_5_6_7_IRQHandler(void)
+{
+    //the last LED word of the frame has been written. The mux channel has
+    //already wrapped and the next update is almost a full step away.
+    DMA1->IFCR = DMA_IFCR_CTCIF5;
+    frame_count++;
+    if (first_frame)
+    {
+        first_frame = false;
+        hook_leds_first_frame();
+    }
+    if (swap_pending)
+    {
+        leds_swap();
+        DMA1_Channel2->CCR &= ~DMA_CCR_EN;
+        DMA1_Channel5->CCR &= ~DMA_CCR_EN;
+        DMA1_Channel2->CMAR = (uint32_t)front->mux;
+        DMA1_Channel5->CMAR = (uint32_t)front->leds;
+        DMA1_Channel2->CNDTR = front->count;
+        DMA1_Channel5->CNDTR = front->count;
+        DMA1_Channel2->CCR |= DMA_CCR_EN;
+        DMA1_Channel5->CCR |= DMA_CCR_EN;
+    }
+}
@@ -10,13 +10,17 @@
 #include "buzzer.h"
 #include "buttons.h"
 #include "leds.h"
+#include "layers.h"
+#include "animation.h"
 #include "i2c.h"
 #include "mma8652.h"
 #include "rtc.h"
 #include "usb.h"
 #include "usb_hid.h"
 #include "power.h"
-#include "osc.h"
+#include "residency.h"
+#include "boot.h"
+#include "alarms.h"
 
 typedef struct __attribute__((packed))
 {
@@ -25,27 +29,166 @@ typedef struct __attribute__((packed))
 } WristwatchReport;
 
 static WristwatchReport report;
+static WristwatchReport in_report;
+
+//HID commands, see host/device/wristwatch.py
+enum { CMD_SET_TIME = 1, CMD_ENTER_BOOTLOADER = 2, CMD_GET_RESIDENCY = 3, CMD_SYNC_TIME = 4,
+    CMD_GET_BOOT_TIMELINE = 5, CMD_GET_ALARMS = 6, CMD_SET_ALARMS = 7 };
+
+//Time sync: the host probes the time to measure the round trip and its
+//offset, then sends the time to apply. Both are answered with the time
+//read right after handling them.
+enum { SYNC_PROBE = 0, SYNC_APPLY = 1 };
+typedef struct __attribute__((packed))
+{
+    uint8_t phase;
+    uint8_t year;
+    uint8_t month;
+    uint8_t day;
+    uint8_t hours;
+    uint8_t minutes;
+    uint8_t seconds;
+    uint16_t milliseconds;
+    uint32_t echo; //returned unchanged, to match answers to requests
+    int32_t offset; //applied offset in answers to SYNC_APPLY (see rtc_sync)
+    uint8_t weekday; //1-7, Monday = 1
+} TimeSyncReport;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t stage_us[BOOT_STAGE_COUNT]; //see boot_get_time
+    uint8_t rtc_clock; //RTCClock
+} BootReport;
+
+//Night profile: the face is dimmed between these hours (24 hour clock)
+#define NIGHT_START_HOUR 22
+#define NIGHT_END_HOUR 7
+#define NIGHT_BRIGHTNESS 20
+#define DAY_BRIGHTNESS 100
+
+//Part of the awake time spent fading out
+#define FADE_MS 500
+
+//Awake time left after an alarm which doesn't show the face stops ringing
+#define ALARM_AWAKE_MS 100
+
+//Battery policy: as VDD falls out of regulation the face is dimmed, shown
+//with fewer levels and kept on for less time. The first entry the battery
+//voltage reaches applies.
+typedef struct {
+    uint16_t min_mv;
+    uint8_t brightness;
+    uint16_t refresh_hz;
+    uint8_t levels;
+    uint16_t awake_ms;
+} BatteryPolicy;
+
+static const BatteryPolicy battery_policies[] = {
+    { 3200, 100, 60, 4, 5000 }, //regulated
+    { 3000, 60, 60, 4, 4000 },
+    { 0, 30, 50, 2, 2500 },
+};
+
+//Shortest wait for an animation change worth dropping to the idle clock for
+#define IDLE_MIN_FRAMES 4
+//The render clock is taken back this long before the second changes, so it
+//is running when the RTC tick requests the redraw
+#define IDLE_SECOND_MARGIN_MS (1000 / POWER_TICK_HZ)
+
+//Display layers, from lowest to highest priority
+enum { LAYER_SECONDS, LAYER_HANDS, LAYER_BATTERY, LAYER_ANIMATION };
+
+static uint8_t last_seconds = 0xFF;
+static bool fading = false;
+static volatile bool face_requested = false;
+static const BatteryPolicy *policy = &battery_policies[0];
 
 static volatile uint8_t segment = 0;
 
+/**
+ * Draws the hands for a time
+ *
+ * now: Time to show
+ */
+static void draw_hands(const RTCSnapshot *now)
+{
+    LEDBitmap bitmap = { 0, 0, 0 };
+
+    //a modulo would be a libgcc division call every second
+    bitmap.minutes = 1ULL << now->minutes;
+    bitmap.hours = 1 << (now->hours >= 12 ? now->hours - 12 : now->hours);
+    layers_set(LAYER_HANDS, &bitmap, 3);
+}
+
+/**
+ * Composes and builds the first frame shown after waking, so that waking
+ * only has to start the display
+ */
+static void prepare_wake_frame(void)
+{
+    RTCSnapshot now;
+
+    fading = false;
+    animation_stop(LAYER_SECONDS);
+    animation_play(LAYER_ANIMATION, &animation_wake_sweep, 0);
+    rtc_get_snapshot(&now);
+    draw_hands(&now);
+    layers_update();
+}
+
+/**
+ * Shows the face for the awake time of the battery policy, or keeps it
+ * shown that long if it already is
+ */
+static void show_face(void)
+{
+    RTCSnapshot now;
+
+    power_set_awake_time(policy->awake_ms);
+    if (fading)
+    {
+        fading = false;
+        animation_stop(LAYER_ANIMATION);
+    }
+    if (leds_is_enabled())
+        return;
+
+    //the wake frame was built before sleeping and only the hands may have
+    //moved since then
+    rtc_get_snapshot(&now);
+    draw_hands(&now);
+    layers_update();
+    leds_enable();
+}
+
 int main(void)
 {
     SystemCoreClockUpdate();
+    boot_start();
 
     buzzer_init();
     buttons_init();
     leds_init();
+    layers_init();
+    animation_init();
     i2c_init();
     mma8652_init();
     rtc_init();
     usb_init();
     power_init();
+    boot_mark(BOOT_STAGE_INIT);
 
     /*RCC->APB1ENR |= RCC_APB1ENR_TIM2EN;
     TIM2->DIER = TIM_DIER_UIE;
     TIM2->CR1 = TIM_CR1_CEN;
     NVIC_EnableIRQ(TIM2_IRQn);*/
 
+    layers_set_enabled(LAYER_SECONDS, true);
+    layers_set_enabled(LAYER_HANDS, true);
+    layers_set_enabled(LAYER_BATTERY, true);
+    layers_set_enabled(LAYER_ANIMATION, true);
+    prepare_wake_frame();
+
     __enable_irq();
 
     power_main();
@@ -60,51 +203,172 @@ void TIM2_IRQHandler()
 
 void hook_power_awake()
 {
-    rtc_refresh();
-    leds_clear();
+    LEDBitmap bitmap = { 0, 0, 0 };
+    RTCSnapshot now;
+
+    residency_tick();
+    boot_tick();
+
+    rtc_poll();
+    if (rtc_get_clock() != RTC_CLOCK_STARTING)
+        boot_mark(BOOT_STAGE_RTC_CLOCK);
+
+    alarms_tick();
+    if (alarms_take_actions() & ALARM_ACTION_DISPLAY)
+        face_requested = true;
+    if (face_requested)
+    {
+        face_requested = false;
+        show_face();
+    }
+    //stay awake for as long as an alarm rings
+    if (alarms_get_ring_time() &&
+            power_get_awake_time() < alarms_get_ring_time() + ALARM_AWAKE_MS)
+        power_set_awake_time(alarms_get_ring_time() + ALARM_AWAKE_MS);
+
+    //kept up to date by the RTC tick
+    rtc_get_snapshot(&now);
+    if (now.hours >= NIGHT_START_HOUR || now.hours < NIGHT_END_HOUR)
+    {
+        leds_set_brightness(NIGHT_BRIGHTNESS < policy->brightness ?
+                NIGHT_BRIGHTNESS : policy->brightness);
+    }
+    else
+    {
+        leds_set_brightness(DAY_BRIGHTNESS < policy->brightness ?
+                DAY_BRIGHTNESS : policy->brightness);
+    }
+
     switch (power_get_battery_state())
     {
     case POWER_BATTERY_CHARGING:
-        leds_set_center(1, 0, 0);
+        bitmap.center = LEDS_CENTER_RED;
         break;
     case POWER_BATTERY_CHARGED:
-        leds_set_center(1, 1, 0);
+        bitmap.center = LEDS_CENTER_RED | LEDS_CENTER_GREEN;
         break;
     default:
-        leds_set_center(0, 1, 0);
+        bitmap.center = LEDS_CENTER_GREEN;
         break;
     }
-    leds_set_minute(rtc_get_minutes(), 3);
-    leds_set_minute(rtc_get_seconds(), 1);
-    leds_set_hour(rtc_get_hours() % 12, 3);
-    leds_commit();
+    layers_set(LAYER_BATTERY, &bitmap, 1);
+
+    //only run fast while there is something to render
+    power_set_idle(now.seconds == last_seconds &&
+            animation_get_frames_until_change() > IDLE_MIN_FRAMES &&
+            rtc_get_ms_until_next_second() > IDLE_SECOND_MARGIN_MS);
+
+    if (now.seconds != last_seconds)
+    {
+        last_seconds = now.seconds;
+        layers_tick();
+
+        animation_play(LAYER_SECONDS, &animation_comet, now.seconds);
+
+        draw_hands(&now);
+    }
+
+    if (!fading && leds_is_enabled() &&
+            power_get_battery_state() == POWER_BATTERY_DISCHARGING &&
+            power_get_awake_time() < FADE_MS)
+    {
+        fading = true;
+        animation_play(LAYER_ANIMATION, &animation_fade_out, 0);
+    }
+
+    animation_update();
+    layers_update();
+}
+
+/**
+ * Selects the battery policy for the measured voltage and applies its
+ * refresh settings
+ */
+static void apply_battery_policy(void)
+{
+    const BatteryPolicy *next = battery_policies;
+    uint16_t mv = power_get_battery_voltage();
+
+    //on USB the battery is charging, whatever it reads
+    if (power_get_battery_state() == POWER_BATTERY_DISCHARGING)
+    {
+        while (mv < next->min_mv)
+            next++;
+    }
+    if (next != policy)
+    {
+        policy = next;
+        leds_set_refresh(policy->refresh_hz, policy->levels);
+    }
 }
 
 void hook_power_on_wake()
 {
-    power_set_awake_time(5000);
-    leds_enable();
+    uint8_t actions;
+
+    last_seconds = 0xFF; //redraw the time even if it looks unchanged
+    apply_battery_policy();
+
+    //the tick was off, so the time is read once here
+    rtc_refresh();
+    rtc_enable_tick();
+
+    //an alarm which only rings leaves the face dark, a button press while
+    //it rings shows it
+    actions = alarms_take_actions();
+    if (actions && !(actions & ALARM_ACTION_DISPLAY))
+    {
+        power_set_awake_time(alarms_get_ring_time() + ALARM_AWAKE_MS);
+        return;
+    }
+    show_face();
 }
 
 void hook_power_on_sleep()
 {
     leds_disable();
+    rtc_disable_tick();
+    prepare_wake_frame();
+}
+
+void hook_leds_first_frame()
+{
+    residency_first_frame();
+    boot_mark(BOOT_STAGE_FIRST_FRAME);
+}
+
+void hook_rtc_second()
+{
+    //draw the new second right at the boundary, not at the next awake tick
+    power_request_update();
+}
+
+void hook_rtc_alarm(RTCAlarm alarm)
+{
+    alarms_fired(alarm);
+    power_request_update();
 }
 
 void hook_power_on_usb_connect()
 {
-    osc_request_hsi16();
+    //charging from here on, so back to the full refresh settings
+    apply_battery_policy();
     usb_enable();
 }
 
 void hook_power_on_usb_disconnect()
 {
+    //the charged battery may still be too low for the full refresh settings
+    apply_battery_policy();
     usb_disable();
-    osc_request_msi(5); //Anything slower than 2MHz makes for some crazy flicker
 }
 
 void hook_buttons_state_changed(uint8_t state)
 {
+    //a press stops an alarm, and shows the face if it only rang
+    alarms_silence();
+    if (!leds_is_enabled())
+        face_requested = true;
     buzzer_trigger_beep();
 }
 
@@ -121,14 +385,86 @@ void hook_usb_hid_out_report_received(const USBTransferData *transfer)
 
     switch (report.command)
     {
-        case 1:
+        case CMD_SET_TIME:
+            //older host software sends no weekday, which keeps the current one
             buzzer_trigger_beep();
-            rtc_set(report.data[0], report.data[1], report.data[2], report.data[3], report.data[4], report.data[5]);
+            rtc_set(report.data[0], report.data[1], report.data[2], report.data[6], report.data[3], report.data[4], report.data[5]);
+            alarms_schedule();
             break;
-        case 2:
+        case CMD_ENTER_BOOTLOADER:
             //entering bootloader mode with a simple soft reset
             NVIC_SystemReset();
             break;
+        case CMD_SYNC_TIME:
+            {
+                USBTransferData data = { &in_report, sizeof(in_report) };
+                const TimeSyncReport *request = (const TimeSyncReport *)report.data;
+                TimeSyncReport *answer = (TimeSyncReport *)in_report.data;
+                RTCSnapshot now;
+
+                answer->offset = 0;
+                if (request->phase == SYNC_APPLY)
+                {
+                    now.year = request->year;
+                    now.month = request->month;
+                    now.day = request->day;
+                    now.weekday = request->weekday;
+                    now.hours = request->hours;
+                    now.minutes = request->minutes;
+                    now.seconds = request->seconds;
+                    now.milliseconds = request->milliseconds;
+                    answer->offset = rtc_sync(&now);
+                    alarms_schedule();
+                }
+
+                rtc_read_now(&now);
+                in_report.command = CMD_SYNC_TIME;
+                answer->phase = request->phase;
+                answer->year = now.year;
+                answer->month = now.month;
+                answer->day = now.day;
+                answer->weekday = now.weekday;
+                answer->hours = now.hours;
+                answer->minutes = now.minutes;
+                answer->seconds = now.seconds;
+                answer->milliseconds = now.milliseconds;
+                answer->echo = request->echo;
+                usb_hid_send(&data);
+            }
+            break;
+        case CMD_GET_BOOT_TIMELINE:
+            {
+                USBTransferData data = { &in_report, sizeof(in_report) };
+                BootReport *answer = (BootReport *)in_report.data;
+
+                in_report.command = CMD_GET_BOOT_TIMELINE;
+                for (uint8_t i = 0; i < BOOT_STAGE_COUNT; i++)
+                    answer->stage_us[i] = boot_get_time(i);
+                answer->rtc_clock = rtc_get_clock();
+                usb_hid_send(&data);
+            }
+            break;
+        case CMD_SET_ALARMS:
+            //the core runs from the HSI16 in range 1 while on USB, so the
+            //EEPROM can be written
+            alarms_set_config((const AlarmsConfig *)report.data);
+            //fall through, the stored settings are the answer
+        case CMD_GET_ALARMS:
+            {
+                USBTransferData data = { &in_report, sizeof(in_report) };
+                in_report.command = CMD_GET_ALARMS;
+                alarms_get_config((AlarmsConfig *)in_report.data);
+                usb_hid_send(&data);
+            }
+            break;
+        case CMD_GET_RESIDENCY:
+            {
+                USBTransferData data = { &in_report, sizeof(in_report) };
+                in_report.command = CMD_GET_RESIDENCY;
+                residency_get_report((ResidencyReport *)in_report.data);
+                usb_hid_send(&data);
+            }
+            break;
         default:
             break;
     }
@@ -0,0 +1,50 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#include "residency.h"
+
+#include "power.h"
+#include "leds.h"
+#include "buzzer.h"
+#include "animation.h"
+
+static uint32_t display_ticks;
+static uint64_t load_ticks; //hundredths of lit LEDs times awake ticks
+static uint32_t wake_latency;
+static uint32_t last_tick;
+
+void residency_first_frame(void)
+{
+    wake_latency = power_get_time_since_wake();
+}
+
+void residency_tick(void)
+{
+    uint32_t tick = power_get_ticks();
+
+    //hook_power_awake also runs for requested updates between ticks
+    if (tick == last_tick || !leds_is_enabled())
+        return;
+    last_tick = tick;
+
+    display_ticks++;
+    load_ticks += leds_get_load();
+}
+
+void residency_get_report(ResidencyReport *report)
+{
+    report->run_msi = power_get_residency(POWER_RES_RUN_MSI) / 1000;
+    report->run_hsi16 = power_get_residency(POWER_RES_RUN_HSI16) / 1000;
+    report->run_lprun = power_get_residency(POWER_RES_RUN_LPRUN) / 1000;
+    report->sleep = power_get_residency(POWER_RES_SLEEP) / 1000;
+    report->stop = power_get_residency(POWER_RES_STOP) / 1000;
+    report->display = display_ticks / POWER_TICK_HZ;
+    report->buzzer = buzzer_get_on_time() / 1000;
+    report->lit_leds = load_ticks / (POWER_TICK_HZ * 100);
+    report->wake_latency = wake_latency;
+    report->render_cycles = animation_get_render_cycles();
+    report->sleep_violations = power_get_sleep_violations();
+}
@@ -7,8 +7,73 @@
 #include "rtc.h"
 
 #include "stm32l0xx.h"
+#include "power.h"
 
-#define ORIGIN_CENTURY 2000
+//Prescalers for 1Hz from the 32.768KHz LSE. The subsecond counter runs at
+//1024Hz for millisecond resolution. A faster asynchronous prescaler would
+//only cost more power.
+#define SUBSECOND_SHIFT 10
+#define PREDIV_A_LSE ((32768 >> SUBSECOND_SHIFT) - 1)
+#define PREDIV_S ((1 << SUBSECOND_SHIFT) - 1)
+//The LSI (nominally 37KHz) divided by 36 is within 0.4% of 1024Hz, far less
+//than its own tolerance
+#define PREDIV_A_LSI 35
+
+//Milliseconds to wait for the LSE before falling back to the LSI, well past
+//the worst case crystal startup. This is uptime rather than awake ticks,
+//which stop while the watch sleeps, so a watch which slept through it
+//falls back as soon as it wakes. An LSE which starts later still replaces
+//the LSI until the calendar is set.
+#define LSE_TIMEOUT_MS 15000
+
+//Odd while the snapshot is being updated and changed by every update, so
+//readers can tell if their copy was interrupted by one
+static volatile RTCSnapshot snapshot;
+static volatile uint8_t sequence;
+
+static RTCClock clock = RTC_CLOCK_STARTING;
+static uint32_t lse_start_ms;
+static bool tick_enabled;
+
+static void rtc_start_tick(void);
+
+/**
+ * Returns the prescaler setting for the RTC clock
+ */
+static uint32_t rtc_prer(void)
+{
+    uint32_t prediv_a = clock == RTC_CLOCK_LSI ? PREDIV_A_LSI : PREDIV_A_LSE;
+    return (prediv_a << RTC_PRER_PREDIV_A_Pos) | PREDIV_S;
+}
+
+/**
+ * Configures the RTC once its clock is running
+ */
+static void rtc_start(void)
+{
+    //Read the calendar directly. The shadow registers are only resynchronized
+    //two RTC clocks after every wake from Stop, which rtc_refresh would have
+    //to wait for, and need a PCLK of 7x the RTC clock (not the case in the
+    //lowest MSI ranges).
+    RTC->WPR = 0xCA;
+    RTC->WPR = 0x53;
+    RTC->CR |= RTC_CR_BYPSHAD;
+
+    //A calendar set with other prescalers keeps running with them, which
+    //would throw off the milliseconds. Changing them restarts the second.
+    if (rtc_is_set() && RTC->PRER != rtc_prer())
+    {
+        RTC->ISR |= RTC_ISR_INIT;
+        while (!(RTC->ISR & RTC_ISR_INITF)) { }
+        RTC->PRER = rtc_prer();
+        RTC->ISR &= ~RTC_ISR_INIT;
+    }
+    RTC->WPR = 0xFF;
+
+    rtc_refresh();
+    if (tick_enabled)
+        rtc_start_tick();
+}
 
 void rtc_init(void)
 {
@@ -16,10 +81,91 @@ void rtc_init(void)
     RCC->APB1ENR |= RCC_APB1ENR_PWREN;
     //enable working with the LSE bits in the CSR
     PWR->CR |= PWR_CR_DBP;
-    RCC->CSR |= RCC_CSR_LSEDRV_0 | RCC_CSR_LSEON; //low medium drive, LSE on
-    while (!(RCC->CSR & RCC_CSR_LSERDY)) { }
-    //enable RTC, select LSE as clock
-    RCC->CSR |= RCC_CSR_RTCEN | RCC_CSR_RTCSEL_0;
+
+    //The wakeup timer marks second boundaries once started by
+    //rtc_enable_tick. The alarms are always unmasked, they are only enabled
+    //in the RTC while programmed.
+    EXTI->RTSR |= EXTI_RTSR_RT17 | EXTI_RTSR_RT20;
+    EXTI->IMR |= EXTI_IMR_IM17;
+    NVIC_EnableIRQ(RTC_IRQn);
+
+    if (RCC->CSR & RCC_CSR_RTCEN)
+    {
+        //The RTC kept running through the reset. Its clock can only be
+        //selected again after a backup domain reset, which would lose the
+        //time, so a previous LSI fallback is kept.
+        if ((RCC->CSR & RCC_CSR_RTCSEL) == RCC_CSR_RTCSEL_1)
+        {
+            RCC->CSR |= RCC_CSR_LSION;
+            while (!(RCC->CSR & RCC_CSR_LSIRDY)) { }
+            clock = RTC_CLOCK_LSI;
+            //until the calendar is set the LSE may still replace the LSI
+            if (!rtc_is_set())
+                RCC->CSR |= RCC_CSR_LSEDRV_0 | RCC_CSR_LSEON;
+        }
+        else
+        {
+            clock = RTC_CLOCK_LSE;
+        }
+        rtc_start();
+    }
+    else
+    {
+        //The LSE takes hundreds of milliseconds to start (forever if the
+        //crystal is damaged), so rtc_poll finishes this later
+        RCC->CSR |= RCC_CSR_LSEDRV_0 | RCC_CSR_LSEON; //low medium drive, LSE on
+        lse_start_ms = power_get_uptime();
+    }
+}
+
+/**
+ * Switches the RTC from the LSI to the LSE. The clock can only be selected
+ * again after a backup domain reset, which clears the calendar, so this
+ * may only be done while it isn't set.
+ */
+static void rtc_switch_to_lse(void)
+{
+    //The reset also stops the LSE and rtc_poll waits for it again. The
+    //awake tick runs from the LSE once it is ready and would stop with it,
+    //so it moves to the LSI until the next wake.
+    RCC->CSR |= RCC_CSR_RTCRST;
+    RCC->CSR &= ~RCC_CSR_RTCRST;
+    RCC->CSR |= RCC_CSR_LSEDRV_0 | RCC_CSR_LSEON;
+    power_restart_tick();
+    clock = RTC_CLOCK_STARTING;
+    lse_start_ms = power_get_uptime();
+}
+
+void rtc_poll(void)
+{
+    if (clock == RTC_CLOCK_LSI && (RCC->CSR & RCC_CSR_LSERDY) && !rtc_is_set())
+        rtc_switch_to_lse();
+
+    if (clock != RTC_CLOCK_STARTING)
+        return;
+
+    if (RCC->CSR & RCC_CSR_LSERDY)
+    {
+        //enable RTC, select LSE as clock
+        clock = RTC_CLOCK_LSE;
+        RCC->CSR |= RCC_CSR_RTCEN | RCC_CSR_RTCSEL_0;
+        rtc_start();
+    }
+    else if (power_get_uptime() - lse_start_ms >= LSE_TIMEOUT_MS)
+    {
+        //enable RTC, select LSI as clock. The LSE is left on in case it is
+        //only slow to start.
+        RCC->CSR |= RCC_CSR_LSION;
+        while (!(RCC->CSR & RCC_CSR_LSIRDY)) { }
+        clock = RTC_CLOCK_LSI;
+        RCC->CSR |= RCC_CSR_RTCEN | RCC_CSR_RTCSEL_1;
+        rtc_start();
+    }
+}
+
+RTCClock rtc_get_clock(void)
+{
+    return clock;
 }
 
 bool rtc_is_set(void)
@@ -29,8 +175,10 @@ bool rtc_is_set(void)
 
 static uint8_t bin_to_bcd(uint8_t binary)
 {
-    uint8_t upper = binary / 10;
-    uint8_t lower = binary % 10;
+    //The M0+ has no divide instruction and a division by 10 would be a
+    //libgcc call. Multiplying by 205/2048 divides by 10 exactly up to 1028.
+    uint8_t upper = (binary * 205) >> 11;
+    uint8_t lower = binary - upper * 10;
     return ((upper & 0xF) << 4) | (lower & 0xF);
 }
 
@@ -39,25 +187,20 @@ static uint8_t bcd_to_bin(uint8_t bcd)
     return ((bcd >> 4) * 10) + (bcd & 0xF);
 }
 
-static uint8_t date_to_weekday(uint8_t year, uint8_t month, uint8_t day)
-{
-    uint16_t y = year + ORIGIN_CENTURY;
-    uint8_t m = month;
-    uint8_t d = day;
-
-    //the following line of code costs around 400 bytes. Hopefully its worth it.
-    //https://en.wikipedia.org/wiki/Determination_of_the_day_of_the_week#Implementation-dependent_methods
-    uint8_t weekday = (d += m < 3 ? y-- : y - 2, 23*m/9 + d + 4 + y/4- y/100 + y/400)%7;
-
-    return weekday + 1; //we require Monday = 1 format
-}
-
 uint8_t yr, mth, dy, hr, mn, sc;
 
-void rtc_set(uint8_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second)
+void rtc_set(uint8_t year, uint8_t month, uint8_t day, uint8_t weekday, uint8_t hour, uint8_t minute, uint8_t second)
 {
     uint8_t year_bcd, month_bcd, day_bcd, hour_bcd, minute_bcd, second_bcd;
-    uint8_t weekday;
+
+    //initialization mode can't be entered without a clock
+    if (clock == RTC_CLOCK_STARTING)
+        return;
+
+    //the RTC doesn't allow a weekday of 0. Older host software sends none,
+    //which keeps the weekday counted so far.
+    if (weekday < 1 || weekday > 7)
+        weekday = (RTC->DR & RTC_DR_WDU) >> RTC_DR_WDU_Pos;
 
     //Unprotect the RTC registers
     RTC->WPR = 0xCA;
@@ -68,7 +211,7 @@ void rtc_set(uint8_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t min
     while (!(RTC->ISR & RTC_ISR_INITF)) { }
 
     //program the prescaler for the 32.768KHz clock
-    RTC->PRER = 0x007F00FF;
+    RTC->PRER = rtc_prer();
 
     yr = year;
     mth = month;
@@ -85,9 +228,6 @@ void rtc_set(uint8_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t min
     minute_bcd = bin_to_bcd(minute);
     second_bcd = bin_to_bcd(second);
 
-    //Determine the weekday
-    weekday = date_to_weekday(year, month, day);
-
     //Program the calendar
     RTC->TR = ((hour_bcd & 0x3F) << RTC_TR_HU_Pos) |
         ((minute_bcd & 0x7F) << RTC_TR_MNU_Pos) |
@@ -97,34 +237,400 @@ void rtc_set(uint8_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t min
         ((month_bcd & 0x1F) << RTC_DR_MU_Pos) |
         ((day_bcd & 0x3F) << RTC_DR_DU_Pos);
 
-    //Set hour format to 24 hours, use shadow registers
-    RTC->CR = 0;
+    //Set hour format to 24 hours, bypass shadow registers
+    RTC->CR &= ~RTC_CR_FMT;
+    RTC->CR |= RTC_CR_BYPSHAD;
 
     //Exit initialization mode
     RTC->ISR &= ~RTC_ISR_INIT;
+
+    rtc_refresh();
+}
+
+/**
+ * Converts a subsecond counter value to milliseconds until the next second
+ *
+ * ss: Subsecond counter, at most PREDIV_S (see rtc_subseconds)
+ *
+ * Returns 1-1000
+ */
+static uint16_t ssr_to_ms_remaining(uint32_t ss)
+{
+    //the counter counts down and the second ends when it would go below 0
+    uint16_t ms = ((ss + 1) * 1000) >> SUBSECOND_SHIFT;
+
+    if (ms < 1)
+        return 1;
+    if (ms > 1000)
+        return 1000;
+    return ms;
+}
+
+/**
+ * Gets the subsecond counter from an SSR value. A shift (see rtc_shift) adds
+ * to the counter, which may take it above PREDIV_S until it has counted
+ * down again. The calendar is one second ahead of the time until then.
+ *
+ * ssr: SSR value
+ * behind: Set if the calendar is one second ahead
+ *
+ * Returns the subsecond counter within the second the time is in
+ */
+static uint32_t rtc_subseconds(uint32_t ssr, bool *behind)
+{
+    uint32_t ss = ssr & RTC_SSR_SS;
+
+    *behind = ss > PREDIV_S;
+    if (*behind)
+        ss -= PREDIV_S + 1;
+    return ss;
+}
+
+static const uint8_t days_in_month[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+/**
+ * Takes one second off a calendar time
+ *
+ * t: Time to change
+ */
+static void rtc_back_one_second(RTCSnapshot *t)
+{
+    if (t->seconds)
+    {
+        t->seconds--;
+        return;
+    }
+    t->seconds = 59;
+    if (t->minutes)
+    {
+        t->minutes--;
+        return;
+    }
+    t->minutes = 59;
+    if (t->hours)
+    {
+        t->hours--;
+        return;
+    }
+    t->hours = 23;
+
+    t->weekday = t->weekday > 1 ? t->weekday - 1 : 7;
+    if (t->day > 1)
+    {
+        t->day--;
+        return;
+    }
+    if (t->month > 1)
+    {
+        t->month--;
+    }
+    else
+    {
+        t->month = 12;
+        t->year = t->year ? t->year - 1 : 99;
+    }
+    //the RTC treats every year divisible by 4 as a leap year
+    t->day = days_in_month[t->month - 1] + (t->month == 2 && !(t->year & 0x3));
+}
+
+/**
+ * Reads the calendar from the RTC
+ *
+ * dest: Snapshot to fill out
+ */
+static void rtc_read_calendar(RTCSnapshot *dest)
+{
+    uint32_t tr, dr, ssr, ss;
+    bool behind;
+
+    //Without the shadow registers the calendar may tick between reads, so
+    //it is read until the time and subseconds are the same before and after
+    //the date
+    do
+    {
+        tr = RTC->TR;
+        ssr = RTC->SSR;
+        dr = RTC->DR;
+    } while (tr != RTC->TR || ssr != RTC->SSR);
+
+    dest->year = bcd_to_bin((dr >> RTC_DR_YU_Pos) & 0xFF);
+    dest->month = bcd_to_bin((dr >> RTC_DR_MU_Pos) & 0x1F);
+    dest->day = bcd_to_bin((dr >> RTC_DR_DU_Pos) & 0x3F);
+    dest->weekday = (dr >> RTC_DR_WDU_Pos) & 0x7;
+    dest->hours = bcd_to_bin((tr >> RTC_TR_HU_Pos) & 0x3F);
+    dest->minutes = bcd_to_bin((tr >> RTC_TR_MNU_Pos) & 0x7F);
+    dest->seconds = bcd_to_bin((tr >> RTC_TR_SU_Pos) & 0x7F);
+
+    ss = rtc_subseconds(ssr, &behind);
+    if (behind)
+        rtc_back_one_second(dest);
+    dest->milliseconds = 1000 - ssr_to_ms_remaining(ss);
+}
+
+/**
+ * Reads the calendar into the snapshot. Interrupts are disabled during the
+ * update so a reader in a higher priority interrupt can't find the sequence
+ * odd and wait forever for it to finish.
+ */
+static void rtc_read(void)
+{
+    RTCSnapshot now;
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    rtc_read_calendar(&now);
+
+    //the barriers keep the copy, which isn't volatile, between the two
+    //sequence changes
+    sequence++;
+    __DMB();
+    *(RTCSnapshot *)&snapshot = now;
+    __DMB();
+    sequence++;
+    __set_PRIMASK(primask);
 }
 
 void rtc_refresh(void)
 {
-    //Wait for the sync flag
-    while (!(RTC->ISR & RTC_ISR_RSF)) { }
+    rtc_read();
+}
+
+void rtc_get_snapshot(RTCSnapshot *dest)
+{
+    uint8_t seq;
+
+    do
+    {
+        seq = sequence;
+        __DMB();
+        *dest = *(const RTCSnapshot *)&snapshot;
+        __DMB();
+    } while ((seq & 1) || seq != sequence);
+}
+
+void rtc_read_now(RTCSnapshot *dest)
+{
+    rtc_read_calendar(dest);
+}
+
+uint16_t rtc_get_ms_until_next_second(void)
+{
+    uint32_t ssr, check;
+    bool behind;
+
+    do
+    {
+        ssr = RTC->SSR;
+        check = RTC->SSR;
+    } while (ssr != check);
+
+    return ssr_to_ms_remaining(rtc_subseconds(ssr, &behind));
+}
+
+/**
+ * Returns the milliseconds since midnight of a time
+ */
+static int32_t rtc_ms_of_day(const RTCSnapshot *t)
+{
+    return ((t->hours * 60L + t->minutes) * 60 + t->seconds) * 1000 + t->milliseconds;
+}
+
+/**
+ * Shifts the calendar by less than a second without stopping it
+ *
+ * ms: Milliseconds to advance the calendar by (-999 to 999)
+ */
+static void rtc_shift(int16_t ms)
+{
+    uint32_t shiftr;
+
+    //SUBFS is added to the down counter, which delays the calendar. An
+    //advance is done as a whole second forward and the rest back.
+    if (ms > 0)
+        shiftr = RTC_SHIFTR_ADD1S | (((1000UL - ms) << SUBSECOND_SHIFT) / 1000);
+    else if (ms < 0)
+        shiftr = ((uint32_t)-ms << SUBSECOND_SHIFT) / 1000;
+    else
+        return;
+
+    RTC->WPR = 0xCA;
+    RTC->WPR = 0x53;
+    //the counter can't overflow into SS[15] with a PREDIV_S this small, so
+    //only a pending shift needs to finish first. Until the counter is back
+    //within PREDIV_S, reads correct for it (see rtc_subseconds).
+    while (RTC->ISR & RTC_ISR_SHPF) { }
+    RTC->SHIFTR = shiftr;
+    RTC->WPR = 0xFF;
+}
+
+int32_t rtc_sync(const RTCSnapshot *target)
+{
+    RTCSnapshot now;
+    int32_t offset = RTC_SYNC_SET;
+
+    if (clock == RTC_CLOCK_STARTING)
+        return RTC_SYNC_SET;
+
+    rtc_read_calendar(&now);
+    if (rtc_is_set() && now.year == target->year && now.month == target->month &&
+            now.day == target->day)
+    {
+        offset = rtc_ms_of_day(target) - rtc_ms_of_day(&now);
+    }
+
+    if (offset > -1000 && offset < 1000)
+    {
+        rtc_shift(offset);
+    }
+    else
+    {
+        //too far off to shift: setting the calendar starts the second over,
+        //so only the milliseconds are left to shift in
+        rtc_set(target->year, target->month, target->day, target->weekday,
+                target->hours, target->minutes, target->seconds);
+        rtc_shift(target->milliseconds);
+    }
+    rtc_refresh();
+
+    return offset;
+}
+
+/**
+ * Starts the wakeup timer at every second boundary
+ */
+static void rtc_start_tick(void)
+{
+    RTC->WPR = 0xCA;
+    RTC->WPR = 0x53;
+
+    //the wakeup timer is reloaded from WUTR on every ck_spre (1Hz) edge, the
+    //same edge which advances the calendar
+    RTC->CR &= ~(RTC_CR_WUTE | RTC_CR_WUTIE);
+    while (!(RTC->ISR & RTC_ISR_WUTWF)) { }
+    RTC->WUTR = 0;
+    RTC->CR = (RTC->CR & ~RTC_CR_WUCKSEL) | RTC_CR_WUCKSEL_2;
+    RTC->CR |= RTC_CR_WUTE | RTC_CR_WUTIE;
+
+    RTC->WPR = 0xFF;
+
+    EXTI->IMR |= EXTI_IMR_IM20;
+}
+
+/**
+ * Stops the wakeup timer and clears its interrupt
+ */
+static void rtc_stop_tick(void)
+{
+    EXTI->IMR &= ~EXTI_IMR_IM20;
+
+    RTC->WPR = 0xCA;
+    RTC->WPR = 0x53;
+    RTC->CR &= ~(RTC_CR_WUTE | RTC_CR_WUTIE);
+    RTC->WPR = 0xFF;
+
+    //INIT is the only bit of ISR which writing 1 would change
+    RTC->ISR = ~(RTC_ISR_WUTF | RTC_ISR_INIT);
+    EXTI->PR = EXTI_PR_PIF20;
+    NVIC_ClearPendingIRQ(RTC_IRQn);
+}
+
+void rtc_enable_tick(void)
+{
+    //without a clock the tick is started along with the RTC
+    tick_enabled = true;
+    if (clock != RTC_CLOCK_STARTING)
+        rtc_start_tick();
+}
+
+void rtc_disable_tick(void)
+{
+    tick_enabled = false;
+    if (clock != RTC_CLOCK_STARTING)
+        rtc_stop_tick();
+}
+
+void rtc_set_alarm(RTCAlarm alarm, uint8_t weekday, uint8_t hours, uint8_t minutes)
+{
+    uint32_t enable = alarm == RTC_ALARM_A ? RTC_CR_ALRAE | RTC_CR_ALRAIE :
+        RTC_CR_ALRBE | RTC_CR_ALRBIE;
+    uint32_t writable = alarm == RTC_ALARM_A ? RTC_ISR_ALRAWF : RTC_ISR_ALRBWF;
+    uint32_t alrmr;
+
+    if (clock == RTC_CLOCK_STARTING)
+        return;
+
+    //the seconds always match 0 and the subseconds are ignored
+    alrmr = ((bin_to_bcd(hours) & 0x3F) << RTC_ALRMAR_HU_Pos) |
+        ((bin_to_bcd(minutes) & 0x7F) << RTC_ALRMAR_MNU_Pos);
+    if (weekday == RTC_ALARM_DAILY)
+        alrmr |= RTC_ALRMAR_MSK4;
+    else
+        alrmr |= RTC_ALRMAR_WDSEL | ((weekday & 0xF) << RTC_ALRMAR_DU_Pos);
+
+    RTC->WPR = 0xCA;
+    RTC->WPR = 0x53;
+    RTC->CR &= ~enable;
+    while (!(RTC->ISR & writable)) { }
+    if (alarm == RTC_ALARM_A)
+    {
+        RTC->ALRMAR = alrmr;
+        RTC->ALRMASSR = 0;
+    }
+    else
+    {
+        RTC->ALRMBR = alrmr;
+        RTC->ALRMBSSR = 0;
+    }
+    RTC->CR |= enable;
+    RTC->WPR = 0xFF;
+}
+
+void rtc_clear_alarm(RTCAlarm alarm)
+{
+    if (clock == RTC_CLOCK_STARTING)
+        return;
+
+    RTC->WPR = 0xCA;
+    RTC->WPR = 0x53;
+    if (alarm == RTC_ALARM_A)
+        RTC->CR &= ~(RTC_CR_ALRAE | RTC_CR_ALRAIE);
+    else
+        RTC->CR &= ~(RTC_CR_ALRBE | RTC_CR_ALRBIE);
+    RTC->WPR = 0xFF;
 
-    //Reset the sync flag
-    RTC->ISR &= ~RTC_ISR_RSF;
+    RTC->ISR = ~((alarm == RTC_ALARM_A ? RTC_ISR_ALRAF : RTC_ISR_ALRBF) | RTC_ISR_INIT);
 }
 
 uint8_t rtc_get_hours(void)
 {
-    return bcd_to_bin((RTC->TR >> RTC_TR_HU_Pos) & 0x3F);
+    return snapshot.hours;
 }
 
 uint8_t rtc_get_minutes(void)
 {
-    return bcd_to_bin((RTC->TR >> RTC_TR_MNU_Pos) & 0x7F);
+    return snapshot.minutes;
 }
 
 uint8_t rtc_get_seconds(void)
 {
-    return bcd_to_bin((RTC->TR >> RTC_TR_SU_Pos) & 0x7F);
+    return snapshot.seconds;
 }
 
+void __attribute__((weak)) hook_rtc_second(void) { }
+void __attribute__((weak)) hook_rtc_alarm(RTCAlarm alarm) { }
+
+void __attribute__((interrupt ("IRQ"))) RTC_IRQHandler(void)
+{
+    uint32_t isr = RTC->ISR & (RTC_ISR_WUTF | RTC_ISR_ALRAF | RTC_ISR_ALRBF);
+
+    RTC->ISR = ~(isr | RTC_ISR_INIT);
+    EXTI->PR = EXTI_PR_PIF17 | EXTI_PR_PIF20;
+
+    rtc_read();
+    if (isr & RTC_ISR_WUTF)
+        hook_rtc_second();
+    if (isr & RTC_ISR_ALRAF)
+        hook_rtc_alarm(RTC_ALARM_A);
+    if (isr & RTC_ISR_ALRBF)
+        hook_rtc_alarm(RTC_ALARM_B);
+}
@@ -0,0 +1,141 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#include "host.h"
+
+#include <string.h>
+
+#include "osc.h"
+
+GPIO_TypeDef host_gpioa, host_gpiob;
+TIM_TypeDef host_tim2, host_tim21, host_tim22;
+DMA_TypeDef host_dma1;
+DMA_Channel_TypeDef host_dma1_channels[7];
+DMA_Request_TypeDef host_dma1_cselr;
+LPTIM_TypeDef host_lptim1;
+EXTI_TypeDef host_exti;
+ADC_Common_TypeDef host_adc_common;
+RTC_TypeDef host_rtc;
+SCB_Type host_scb;
+NVIC_Type host_nvic;
+
+static RCC_TypeDef rcc;
+static PWR_TypeDef pwr;
+static SYSCFG_TypeDef syscfg;
+static ADC_TypeDef adc1;
+
+uint32_t host_primask;
+uint32_t host_wfi_count;
+unsigned int host_failures;
+
+uint32_t SystemCoreClock = 2097152;
+
+void SystemCoreClockUpdate(void) { }
+
+void host_reset(void)
+{
+    memset(&host_gpioa, 0, sizeof(host_gpioa));
+    memset(&host_gpiob, 0, sizeof(host_gpiob));
+    memset(&host_tim2, 0, sizeof(host_tim2));
+    memset(&host_tim21, 0, sizeof(host_tim21));
+    memset(&host_tim22, 0, sizeof(host_tim22));
+    memset(&host_dma1, 0, sizeof(host_dma1));
+    memset(host_dma1_channels, 0, sizeof(host_dma1_channels));
+    memset(&host_dma1_cselr, 0, sizeof(host_dma1_cselr));
+    memset(&host_lptim1, 0, sizeof(host_lptim1));
+    memset(&host_exti, 0, sizeof(host_exti));
+    memset(&host_adc_common, 0, sizeof(host_adc_common));
+    memset(&host_rtc, 0, sizeof(host_rtc));
+    memset(&host_scb, 0, sizeof(host_scb));
+    memset(&host_nvic, 0, sizeof(host_nvic));
+    memset(&rcc, 0, sizeof(rcc));
+    memset(&pwr, 0, sizeof(pwr));
+    memset(&syscfg, 0, sizeof(syscfg));
+    memset(&adc1, 0, sizeof(adc1));
+
+    //every pin is analog after reset, except for SWD
+    host_gpioa.MODER = 0xEBFFFCFF;
+    host_gpioa.PUPDR = 0x24000000;
+    host_gpiob.MODER = 0xFFFFFFFF;
+
+    host_primask = 0;
+    host_wfi_count = 0;
+}
+
+RCC_TypeDef *host_rcc(void)
+{
+    //oscillators are ready as soon as they are turned on
+    if (rcc.CSR & RCC_CSR_LSION)
+        rcc.CSR |= RCC_CSR_LSIRDY;
+    else
+        rcc.CSR &= ~RCC_CSR_LSIRDY;
+    if (rcc.CSR & RCC_CSR_LSEON)
+        rcc.CSR |= RCC_CSR_LSERDY;
+    else
+        rcc.CSR &= ~RCC_CSR_LSERDY;
+    rcc.CFGR = (rcc.CFGR & ~RCC_CFGR_SWS) | ((rcc.CFGR & RCC_CFGR_SW) << RCC_CFGR_SWS_Pos);
+    return &rcc;
+}
+
+PWR_TypeDef *host_pwr(void)
+{
+    //the regulator follows the low power run bit immediately
+    if (pwr.CR & PWR_CR_LPRUN)
+        pwr.CSR |= PWR_CSR_REGLPF;
+    else
+        pwr.CSR &= ~PWR_CSR_REGLPF;
+    return &pwr;
+}
+
+SYSCFG_TypeDef *host_syscfg(void)
+{
+    syscfg.CFGR3 |= SYSCFG_CFGR3_VREFINT_RDYF;
+    return &syscfg;
+}
+
+ADC_TypeDef *host_adc1(void)
+{
+    //calibration, enabling, conversions and disabling finish instantly. The
+    //conversion result is left at zero.
+    adc1.CR &= ~ADC_CR_ADCAL;
+    if (adc1.CR & ADC_CR_ADDIS)
+        adc1.CR &= ~(ADC_CR_ADDIS | ADC_CR_ADEN);
+    if (adc1.CR & ADC_CR_ADEN)
+        adc1.ISR |= ADC_ISR_ADRDY;
+    if (adc1.CR & ADC_CR_ADSTART)
+    {
+        adc1.CR &= ~ADC_CR_ADSTART;
+        adc1.ISR |= ADC_ISR_EOC;
+    }
+    return &adc1;
+}
+
+uint32_t host_gpio_update(void)
+{
+    GPIO_TypeDef *ports[] = { &host_gpioa, &host_gpiob };
+
+    for (uint8_t i = 0; i < sizeof(ports)/sizeof(*ports); i++)
+    {
+        uint32_t bsrr = ports[i]->BSRR_reg[0];
+        ports[i]->ODR_reg[0] = (ports[i]->ODR_reg[0] & ~(bsrr >> 16)) | (bsrr & 0xFFFF);
+        ports[i]->BSRR_reg[0] = 0;
+    }
+    return 0;
+}
+
+void host_wfi(void)
+{
+    host_wfi_count++;
+    host_nvic.ISPR[0] |= host_nvic.ISER[0];
+}
+
+//The oscillator module only matters on the target, every request is granted
+OscRequirement osc_add_requirement(uint32_t min_hz) { return 0; }
+void osc_set_requirement(OscRequirement req, uint32_t min_hz) { }
+void osc_acquire(OscRequirement req) { }
+void osc_release(OscRequirement req) { }
+void osc_add_callback(OscChangeCallback fn) { }
+uint32_t osc_get_switch_time(void) { return 0; }
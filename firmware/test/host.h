@@ -0,0 +1,173 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+/**
+ * Host test support
+ *
+ * Tests include the module under test after this header, so its static
+ * functions and variables can be reached directly. The peripherals are
+ * redirected to plain structs and the core intrinsics to functions, which
+ * is enough for code that busy-waits on a few status bits as long as the
+ * model below sets them.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//The device header's GPIO port is replaced below
+#define GPIO_TypeDef HostDeviceGPIO_TypeDef
+#include "stm32l0xx.h"
+#undef GPIO_TypeDef
+#include "system_stm32l0xx.h"
+
+/**
+ * GPIO port with BSRR writes modelled. ODR and BSRR are single element
+ * arrays indexed through host_gpio_update, so every access to either first
+ * applies the BSRR writes since the last one to ODR.
+ */
+typedef struct {
+    __IO uint32_t MODER;
+    __IO uint32_t OTYPER;
+    __IO uint32_t OSPEEDR;
+    __IO uint32_t PUPDR;
+    __IO uint32_t IDR;
+    __IO uint32_t ODR_reg[1];
+    __IO uint32_t BSRR_reg[1];
+    __IO uint32_t LCKR;
+    __IO uint32_t AFR[2];
+    __IO uint32_t BRR;
+} GPIO_TypeDef;
+
+/**
+ * Applies a pending BSRR write of every port to its ODR: the reset bits,
+ * then the set bits, which take priority like on the device
+ *
+ * Returns 0, the index of ODR and BSRR
+ */
+uint32_t host_gpio_update(void);
+
+#define ODR ODR_reg[host_gpio_update()]
+#define BSRR BSRR_reg[host_gpio_update()]
+
+//Peripherals without any modelled behavior
+extern GPIO_TypeDef host_gpioa, host_gpiob;
+extern TIM_TypeDef host_tim2, host_tim21, host_tim22;
+extern DMA_TypeDef host_dma1;
+extern DMA_Channel_TypeDef host_dma1_channels[7];
+extern DMA_Request_TypeDef host_dma1_cselr;
+extern LPTIM_TypeDef host_lptim1;
+extern EXTI_TypeDef host_exti;
+extern ADC_Common_TypeDef host_adc_common;
+extern RTC_TypeDef host_rtc;
+extern SCB_Type host_scb;
+extern NVIC_Type host_nvic;
+
+/**
+ * Peripherals with status bits the firmware waits on. Every access goes
+ * through a function which first updates the bits from the control
+ * registers, like the hardware would have done by then.
+ */
+RCC_TypeDef *host_rcc(void);
+PWR_TypeDef *host_pwr(void);
+SYSCFG_TypeDef *host_syscfg(void);
+ADC_TypeDef *host_adc1(void);
+
+#undef GPIOA
+#define GPIOA (&host_gpioa)
+#undef GPIOB
+#define GPIOB (&host_gpiob)
+#undef TIM2
+#define TIM2 (&host_tim2)
+#undef TIM21
+#define TIM21 (&host_tim21)
+#undef TIM22
+#define TIM22 (&host_tim22)
+#undef DMA1
+#define DMA1 (&host_dma1)
+#undef DMA1_Channel1
+#define DMA1_Channel1 (&host_dma1_channels[0])
+#undef DMA1_Channel2
+#define DMA1_Channel2 (&host_dma1_channels[1])
+#undef DMA1_Channel3
+#define DMA1_Channel3 (&host_dma1_channels[2])
+#undef DMA1_Channel4
+#define DMA1_Channel4 (&host_dma1_channels[3])
+#undef DMA1_Channel5
+#define DMA1_Channel5 (&host_dma1_channels[4])
+#undef DMA1_Channel6
+#define DMA1_Channel6 (&host_dma1_channels[5])
+#undef DMA1_Channel7
+#define DMA1_Channel7 (&host_dma1_channels[6])
+#undef DMA1_CSELR
+#define DMA1_CSELR (&host_dma1_cselr)
+#undef LPTIM1
+#define LPTIM1 (&host_lptim1)
+#undef EXTI
+#define EXTI (&host_exti)
+#undef ADC1_COMMON
+#define ADC1_COMMON (&host_adc_common)
+#undef ADC
+#define ADC (&host_adc_common)
+#undef RTC
+#define RTC (&host_rtc)
+#undef SCB
+#define SCB (&host_scb)
+#undef NVIC
+#define NVIC (&host_nvic)
+#undef RCC
+#define RCC (host_rcc())
+#undef PWR
+#define PWR (host_pwr())
+#undef SYSCFG
+#define SYSCFG (host_syscfg())
+#undef ADC1
+#define ADC1 (host_adc1())
+
+//Core intrinsics
+extern uint32_t host_primask;
+extern uint32_t host_wfi_count;
+
+/**
+ * Waits for an interrupt: every enabled interrupt becomes pending
+ */
+void host_wfi(void);
+
+#define __disable_irq() (host_primask = 1)
+#define __enable_irq() (host_primask = 0)
+#define __get_PRIMASK() (host_primask)
+#define __set_PRIMASK(x) (host_primask = (x))
+#define __WFI() host_wfi()
+
+//Handlers are ordinary functions on the host
+#define interrupt(type)
+
+#define NVIC_EnableIRQ(irq) (host_nvic.ISER[0] |= 1UL << (irq))
+#define NVIC_DisableIRQ(irq) (host_nvic.ISER[0] &= ~(1UL << (irq)))
+#define NVIC_SetPendingIRQ(irq) (host_nvic.ISPR[0] |= 1UL << (irq))
+#define NVIC_ClearPendingIRQ(irq) (host_nvic.ISPR[0] &= ~(1UL << (irq)))
+#define NVIC_SetPriority(irq, priority) ((void)(irq), (void)(priority))
+
+/**
+ * Resets every peripheral to zero and the GPIO ports to their reset state
+ */
+void host_reset(void);
+
+/**
+ * Checks a condition, printing the failure and counting it
+ */
+extern unsigned int host_failures;
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        host_failures++; \
+    } \
+} while (0)
+
+#endif //_HOST_H_
@@ -0,0 +1,72 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#include "host.h"
+
+#include <string.h>
+
+#include "power.h"
+#include "power_hooks.h"
+
+char power_hooks_log[256];
+
+//What the hooks have been told so far
+static bool awake;
+static bool usb;
+
+/**
+ * Appends a hook to the log
+ */
+static void power_hooks_record(const char *name)
+{
+    if (power_hooks_log[0])
+        strcat(power_hooks_log, ",");
+    strcat(power_hooks_log, name);
+}
+
+void power_hooks_clear(void)
+{
+    power_hooks_log[0] = '\0';
+}
+
+void hook_power_awake(void)
+{
+    CHECK(awake);
+    power_hooks_record("awake");
+}
+
+void hook_power_on_wake(void)
+{
+    CHECK(!awake);
+    awake = true;
+    power_hooks_record("wake");
+
+    //like the application, show the face for a while
+    power_set_awake_time(POWER_HOOKS_AWAKE_MS);
+}
+
+void hook_power_on_sleep(void)
+{
+    //the USB is always unplugged first
+    CHECK(awake && !usb);
+    awake = false;
+    power_hooks_record("sleep");
+}
+
+void hook_power_on_usb_connect(void)
+{
+    //the device is always woken first
+    CHECK(awake && !usb);
+    usb = true;
+    power_hooks_record("connect");
+}
+
+void hook_power_on_usb_disconnect(void)
+{
+    CHECK(awake);
+    usb = false;
+    power_hooks_record("disconnect");
+}
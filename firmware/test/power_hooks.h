@@ -0,0 +1,28 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#ifndef _POWER_HOOKS_H_
+#define _POWER_HOOKS_H_
+
+/**
+ * Power hooks for the host tests
+ *
+ * The hooks are defined apart from the power module, which defines weak
+ * ones of its own. They check the order they are called in and log their
+ * names, comma separated.
+ */
+
+//Awake time set by hook_power_on_wake
+#define POWER_HOOKS_AWAKE_MS 1000
+
+extern char power_hooks_log[256];
+
+/**
+ * Clears the hook log
+ */
+void power_hooks_clear(void);
+
+#endif //_POWER_HOOKS_H_
@@ -0,0 +1,449 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#include "host.h"
+
+#include "../src/leds.c"
+
+#define TEST_UNIT_TICKS 200
+
+/**
+ * What the LEDs show during one time unit, read back from the GPIO ports
+ */
+typedef struct {
+    uint8_t segment; //mux select
+    uint8_t leds; //LED pins
+} PortState;
+
+/**
+ * The lit time units of a frame in the order they are shown. Units with the
+ * mux disabled or no LED lit are left out, since interrupt mode folds them
+ * into a blank step at the end of the frame.
+ */
+typedef struct {
+    PortState units[FRAME_MAX_STEPS];
+    uint16_t count;
+} PortOutput;
+
+/**
+ * Hardware ordered segment values of every plane, as the baseline display
+ * held them for its single plane
+ */
+typedef uint8_t BaselineDisplay[LEDS_PLANE_COUNT][16];
+
+static LEDFrame test_frame;
+
+/**
+ * Appends the state of the GPIO ports to an output, if anything is lit
+ *
+ * out: Output to append to
+ * units: Time units the state is shown for
+ */
+static void test_capture(PortOutput *out, uint32_t units)
+{
+    uint32_t odr_a = host_gpioa.ODR;
+    uint32_t odr_b = host_gpiob.ODR;
+
+    if ((odr_b & GPIO_ODR_OD7) || !(odr_a & LED_PIN_MASK))
+        return;
+    for (uint32_t i = 0; i < units; i++)
+    {
+        CHECK(out->count < FRAME_MAX_STEPS);
+        if (out->count >= FRAME_MAX_STEPS)
+            return;
+        out->units[out->count].segment = (odr_b & MUX_PIN_MASK) >> 3;
+        out->units[out->count].leds = odr_a & LED_PIN_MASK;
+        out->count++;
+    }
+}
+
+/**
+ * Copied from the display interrupt from before bit planes
+ */
+static uint8_t baseline_reverse_byte(uint8_t b) {
+   b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+   b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+   b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+   return b;
+}
+
+/**
+ * Outputs a segment like the display interrupt from before bit planes did,
+ * computing the BSRR words from ODR
+ */
+static void baseline_output(uint8_t segment, uint8_t segmentValue)
+{
+    //to ease routing, odd segments are wired backwards for the minutes
+    if ((segment % 2) && segment < 12)
+    {
+        segmentValue = baseline_reverse_byte(segmentValue) >> 3 | (segmentValue & 0x20);
+    }
+
+    //turn off mux, set new mux value
+    uint8_t muxValue = segment << 3;
+    GPIOB->BSRR = (((GPIOB->ODR & MUX_PIN_MASK) ^ muxValue) & muxValue) |
+        ((((GPIOB->ODR & MUX_PIN_MASK) ^ muxValue) & GPIOB->ODR) << 16) |
+        GPIO_BSRR_BS_7;
+
+    //set led value
+    GPIOA->BSRR = (((GPIOA->ODR & LED_PIN_MASK) ^ segmentValue) & segmentValue) |
+        ((((GPIOA->ODR & LED_PIN_MASK) ^ segmentValue) & GPIOA->ODR) << 16);
+
+    //enable mux
+    GPIOB->BSRR = GPIO_BSRR_BR_7;
+}
+
+/**
+ * Shows every shown plane of every segment for its weight with the baseline
+ * interrupt's output
+ */
+static void baseline_frame(const BaselineDisplay display, PortOutput *out)
+{
+    uint8_t first_plane = LEDS_PLANE_COUNT - plane_count;
+
+    memset(out, 0, sizeof(PortOutput));
+    for (uint8_t segment = 0; segment < 16; segment++)
+    {
+        for (uint8_t plane = first_plane; plane < LEDS_PLANE_COUNT; plane++)
+        {
+            baseline_output(segment, display[plane][segment]);
+            test_capture(out, 1 << (plane - first_plane));
+        }
+    }
+}
+
+/**
+ * Fills a baseline display from an image the way the baseline
+ * leds_set_minute, leds_set_hour and leds_set_center did, one plane at a
+ * time
+ */
+static void baseline_display(BaselineDisplay display, const LEDImage *image)
+{
+    memset(display, 0, sizeof(BaselineDisplay));
+    for (uint8_t plane = 0; plane < LEDS_PLANE_COUNT; plane++)
+    {
+        const LEDBitmap *bitmap = &image->planes[plane];
+        for (uint8_t led = 0; led < LEDS_MINUTE_COUNT; led++)
+        {
+            if (bitmap->minutes & (1ULL << led))
+                display[plane][led / 5] |= 1 << (led % 5);
+        }
+        for (uint8_t led = 0; led < LEDS_HOUR_COUNT; led++)
+        {
+            if (bitmap->hours & (1 << led))
+                display[plane][led] |= 0x20;
+        }
+        //the rework: red and green are reversed
+        if (bitmap->center & LEDS_CENTER_RED)
+            display[plane][13] |= 0x01;
+        if (bitmap->center & LEDS_CENTER_GREEN)
+            display[plane][12] |= 0x01;
+    }
+}
+
+/**
+ * Runs an interrupt mode frame through the display interrupt
+ */
+static void test_interrupt_frame(const LEDDisplay *display, PortOutput *out)
+{
+    LEDFrame *saved = front;
+    uint32_t frame_ticks = 0;
+
+    mode = LEDS_MODE_INTERRUPT;
+    leds_build_frame(&test_frame, display);
+
+    memset(out, 0, sizeof(PortOutput));
+    front = &test_frame;
+    status.current_step = 0;
+    swap_pending = false;
+    first_frame = false;
+    for (uint8_t step = 0; step < test_frame.count; step++)
+    {
+        TIM21_IRQHandler();
+        frame_ticks += host_tim21.ARR + 1;
+        if (!(host_gpiob.ODR & GPIO_ODR_OD7))
+        {
+            CHECK((host_tim21.ARR + 1) % lit_ticks == 0);
+            test_capture(out, (host_tim21.ARR + 1) / lit_ticks);
+        }
+    }
+    CHECK(!status.current_step);
+    CHECK(frame_ticks == (uint32_t)unit_ticks * leds_frame_units(plane_count));
+    front = saved;
+
+    //the blank step keeps the blue pin high with the mux off
+    CHECK(test_frame.enable[test_frame.count - 1] ||
+            (host_gpiob.ODR & GPIO_ODR_OD7 && host_gpioa.ODR & GPIO_ODR_OD5));
+}
+
+/**
+ * Runs a DMA mode frame through the transfers TIM2 triggers in each time
+ * unit: the mux step, the LED step and the mux enable
+ */
+static void test_dma_frame(const LEDDisplay *display, PortOutput *out)
+{
+    mode = LEDS_MODE_DMA;
+    leds_build_frame(&test_frame, display);
+    CHECK(test_frame.count == leds_frame_units(plane_count));
+
+    memset(out, 0, sizeof(PortOutput));
+    for (uint8_t step = 0; step < test_frame.count; step++)
+    {
+        GPIOB->BSRR = test_frame.mux[step];
+        GPIOA->BSRR = test_frame.leds[step];
+        GPIOB->BSRR = dma_mux_enable;
+        test_capture(out, 1);
+    }
+}
+
+/**
+ * Checks that an output matches the reference
+ */
+static void test_same_output(int line, const PortOutput *out, const PortOutput *expected)
+{
+    if (out->count != expected->count ||
+            memcmp(out->units, expected->units, out->count * sizeof(PortState)))
+    {
+        printf("%s:%d: port output differs from the baseline\n", __FILE__, line);
+        host_failures++;
+    }
+}
+
+/**
+ * Shows a display in both modes and checks the port states against the
+ * baseline interrupt showing the same segments
+ */
+static void test_display(const LEDDisplay *display, const BaselineDisplay reference)
+{
+    PortOutput expected, out;
+
+    baseline_frame(reference, &expected);
+    test_interrupt_frame(display, &out);
+    test_same_output(__LINE__, &out, &expected);
+    test_dma_frame(display, &out);
+    test_same_output(__LINE__, &out, &expected);
+}
+
+/**
+ * Tests every value of every segment in every plane, on an empty and on a
+ * fully lit display
+ */
+static void test_all_segments(void)
+{
+    static const uint8_t backgrounds[] = { 0x00, 0x3F };
+    LEDDisplay display;
+    BaselineDisplay reference;
+
+    for (uint8_t b = 0; b < sizeof(backgrounds); b++)
+    {
+        for (uint8_t plane = 0; plane < LEDS_PLANE_COUNT; plane++)
+        {
+            for (uint8_t segment = 0; segment < 16; segment++)
+            {
+                for (uint8_t value = 0; value < 0x40; value++)
+                {
+                    memset(&display, backgrounds[b], sizeof(display));
+                    memset(reference, backgrounds[b], sizeof(reference));
+                    display.planes[plane].segments[segment].segment = value;
+                    reference[plane][segment] = value;
+                    test_display(&display, reference);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Tests every LED at every level on an empty and on a fully lit image,
+ * through the conversion to the hardware ordered display
+ */
+static void test_all_leds(void)
+{
+    LEDBitmap all = { MINUTE_MASK, HOUR_MASK, LEDS_CENTER_RED | LEDS_CENTER_GREEN };
+    LEDImage image;
+    LEDDisplay display;
+    BaselineDisplay reference;
+
+    for (uint8_t background = 0; background < 4; background += 3)
+    {
+        for (uint8_t led = 0; led < LEDS_MINUTE_COUNT + LEDS_HOUR_COUNT + 2; led++)
+        {
+            for (uint8_t level = 0; level < 4; level++)
+            {
+                LEDBitmap bitmap = { 0, 0, 0 };
+                if (led < LEDS_MINUTE_COUNT)
+                    bitmap.minutes = 1ULL << led;
+                else if (led < LEDS_MINUTE_COUNT + LEDS_HOUR_COUNT)
+                    bitmap.hours = 1 << (led - LEDS_MINUTE_COUNT);
+                else
+                    bitmap.center = 1 << (led - LEDS_MINUTE_COUNT - LEDS_HOUR_COUNT);
+
+                leds_image_clear(&image);
+                leds_image_set(&image, &all, background);
+                leds_image_set(&image, &bitmap, level);
+                leds_bitmap_to_display(&display, &image);
+                baseline_display(reference, &image);
+                test_display(&display, reference);
+            }
+        }
+    }
+}
+
+/**
+ * Checks that limiting an image lowers only the LEDs above the limit
+ */
+static void test_image_limit(void)
+{
+    LEDImage image;
+
+    for (uint8_t limit = 0; limit < 4; limit++)
+    {
+        //one hour LED and a few minute LEDs at every level
+        leds_image_clear(&image);
+        for (uint8_t level = 0; level < 4; level++)
+        {
+            LEDBitmap bitmap = { 1ULL << (level * 15), 1 << level, 0 };
+            leds_image_set(&image, &bitmap, level);
+        }
+        leds_image_limit(&image, limit);
+
+        for (uint8_t level = 0; level < 4; level++)
+        {
+            uint8_t expected = level < limit ? level : limit;
+            uint8_t minute = 0, hour = 0;
+            for (uint8_t i = 0; i < LEDS_PLANE_COUNT; i++)
+            {
+                if (image.planes[i].minutes & (1ULL << (level * 15)))
+                    minute |= 1 << i;
+                if (image.planes[i].hours & (1 << level))
+                    hour |= 1 << i;
+            }
+            CHECK(minute == expected);
+            CHECK(hour == expected);
+        }
+    }
+}
+
+/**
+ * Checks that a restarted display outputs the first step of the frame
+ * presented while it was stopped, even if that frame is shorter
+ */
+static void test_restart(void)
+{
+    mode = LEDS_MODE_INTERRUPT;
+    plane_count = LEDS_PLANE_COUNT;
+    lit_ticks = TEST_UNIT_TICKS / 4;
+    memset(&commit_image, 0xFF, sizeof(commit_image));
+    leds_present();
+    leds_start();
+    for (uint8_t i = 0; i < front->count - 2; i++)
+        TIM21_IRQHandler();
+    CHECK(status.current_step == front->count - 2);
+    leds_stop();
+
+    leds_image_clear(&commit_image);
+    commit_image.planes[0].hours = 1;
+    leds_present();
+    CHECK(front->count == 2);
+
+    leds_start();
+    CHECK(host_tim21.CNT == host_tim21.ARR);
+    TIM21_IRQHandler();
+    CHECK((host_gpiob.ODR & (MUX_PIN_MASK | GPIO_ODR_OD7)) == (front->mux[0] & MUX_PIN_MASK));
+    CHECK((host_gpioa.ODR & LED_PIN_MASK) == (front->leds[0] & LED_PIN_MASK));
+    CHECK(host_tim21.ARR == front->periods[0]);
+    CHECK(status.current_step == 1);
+    leds_stop();
+}
+
+/**
+ * Checks the load estimate, which divides by the plane weight with a
+ * multiply
+ */
+static void test_load(void)
+{
+    LEDBitmap all = { MINUTE_MASK, HOUR_MASK, LEDS_CENTER_RED | LEDS_CENTER_GREEN };
+
+    leds_set_refresh(LED_DEFAULT_REFRESH_HZ, 4);
+    brightness = 100;
+    leds_image_clear(&commit_image);
+    leds_image_set(&commit_image, &all, 3);
+    CHECK(leds_estimate_load() == 74 * 100);
+    leds_image_set(&commit_image, &all, 1);
+    CHECK(leds_estimate_load() == 74 * 100 / 3);
+    leds_image_set(&commit_image, &all, 2);
+    CHECK(leds_estimate_load() == 74 * 100 * 2 / 3);
+
+    leds_set_refresh(LED_DEFAULT_REFRESH_HZ, 2);
+    CHECK(leds_estimate_load() == 74 * 100);
+    leds_image_set(&commit_image, &all, 1);
+    CHECK(leds_estimate_load() == 0);
+}
+
+/**
+ * Checks that switching back to a recent clock reuses its timing
+ */
+static void test_timing(void)
+{
+    uint16_t slow_unit, slow_lit;
+
+    SystemCoreClock = 2097152;
+    leds_set_refresh(LED_DEFAULT_REFRESH_HZ, 4);
+    leds_set_brightness(50);
+    slow_unit = unit_ticks;
+    slow_lit = lit_ticks;
+    CHECK(slow_unit == 2097152 / (LED_DEFAULT_REFRESH_HZ * 48));
+    CHECK(slow_lit == slow_unit / 2);
+    CHECK(host_tim2.ARR == slow_unit - 1u);
+
+    SystemCoreClock = 16000000;
+    leds_set_timing();
+    CHECK(unit_ticks != slow_unit);
+    CHECK(host_tim21.PSC == (16000000 / LED_DEFAULT_REFRESH_HZ) >> 16);
+
+    SystemCoreClock = 2097152;
+    leds_set_timing();
+    CHECK(unit_ticks == slow_unit);
+    CHECK(lit_ticks == slow_lit);
+    CHECK(host_tim21.PSC == 0);
+    CHECK(host_tim2.ARR == slow_unit - 1u);
+
+    //a brightness change is a different timing
+    leds_set_brightness(25);
+    CHECK(lit_ticks == slow_unit / 4);
+    SystemCoreClock = 16000000;
+    leds_set_timing();
+    CHECK(lit_ticks == unit_ticks / 4);
+}
+
+int main(void)
+{
+    host_reset();
+    unit_ticks = TEST_UNIT_TICKS;
+
+    for (plane_count = 1; plane_count <= LEDS_PLANE_COUNT; plane_count++)
+    {
+        //full brightness, and dimmed so the interrupt frame needs a blank step
+        lit_ticks = TEST_UNIT_TICKS;
+        test_all_segments();
+        test_all_leds();
+        lit_ticks = TEST_UNIT_TICKS / 4;
+        test_all_segments();
+        test_all_leds();
+    }
+
+    test_image_limit();
+    test_restart();
+    test_load();
+    test_timing();
+
+    if (host_failures)
+    {
+        printf("test_leds: %u failures\n", host_failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,185 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#include "host.h"
+
+#include <string.h>
+
+#include "../../common/src/power.c"
+#include "power_hooks.h"
+
+#define TEST_AWAKE_TICKS (POWER_HOOKS_AWAKE_MS * POWER_TICK_HZ / 1000)
+
+/**
+ * Runs the state machine once and checks the hooks it called
+ *
+ * event: Settled input event
+ * posted: Events posted by interrupts since the last pass
+ * expected: Hooks expected in order, comma separated
+ */
+static void test_step(int line, PowerEvent event, uint8_t posted, const char *expected)
+{
+    power_hooks_clear();
+    flags = posted;
+    power_fsm_tick(event);
+    if (strcmp(power_hooks_log, expected))
+    {
+        printf("%s:%d: expected hooks \"%s\", got \"%s\"\n", __FILE__, line,
+                expected, power_hooks_log);
+        host_failures++;
+    }
+}
+#define TEST_STEP(event, posted, expected) test_step(__LINE__, event, posted, expected)
+
+/**
+ * Checks that the device went through Stop and came back out of it
+ */
+static void test_slept(void)
+{
+    CHECK(host_wfi_count);
+    CHECK(!(host_scb.SCR & SCB_SCR_SLEEPDEEP_Msk));
+    CHECK(!host_primask);
+    host_wfi_count = 0;
+}
+
+/**
+ * Changes the inputs, as an edge on them would
+ *
+ * inputs: USB presence and charge status pins, as read from IDR
+ */
+static void test_edge(uint32_t inputs)
+{
+    host_gpiob.IDR = (host_gpiob.IDR & ~(USB_PRES_MASK | BAT_CHG_MASK)) | inputs;
+    EXTI0_1_IRQHandler();
+    CHECK(events & POWER_FLAG_INPUT);
+    events = 0;
+}
+
+/**
+ * Lets awake ticks pass, checking that nothing is reported until the last
+ *
+ * count: Awake ticks to pass
+ * expected: Event expected after the last tick
+ */
+static void test_settle(int line, uint32_t count, PowerEvent expected)
+{
+    PowerEvent event;
+
+    for (uint32_t i = 1; i <= count; i++)
+    {
+        LPTIM1_IRQHandler();
+        event = power_get_event();
+        if (i < count ? event != PWR_EVT_NONE : event != expected)
+        {
+            printf("%s:%d: tick %u: expected event %d, got %d\n", __FILE__, line,
+                    i, i < count ? PWR_EVT_NONE : expected, event);
+            host_failures++;
+        }
+    }
+    events = 0;
+}
+#define TEST_SETTLE(count, expected) test_settle(__LINE__, count, expected)
+
+/**
+ * Checks the debouncing of the inputs from their interrupt to the event
+ * the state machine gets
+ */
+static void test_debounce(void)
+{
+    //on battery and not charging, settled
+    host_gpiob.IDR = USB_PRES_MASK | BAT_CHG_MASK;
+    input_state = USB_PRES_MASK | BAT_CHG_MASK;
+    debouncing = false;
+    CHECK(power_get_event() == PWR_EVT_NONE);
+
+    //plugged in for good
+    test_edge(BAT_CHG_MASK);
+    TEST_SETTLE(POWER_DEBOUNCE_TICKS, PWR_EVT_USB_CONNECT);
+    CHECK(input_state == BAT_CHG_MASK);
+    TEST_SETTLE(POWER_DEBOUNCE_TICKS, PWR_EVT_NONE);
+
+    //charging starts, which doesn't change USB presence
+    test_edge(0);
+    TEST_SETTLE(POWER_DEBOUNCE_TICKS, PWR_EVT_NONE);
+    CHECK(input_state == 0);
+
+    //the plug bounces and every edge restarts the settling time, but it
+    //stays in
+    test_edge(USB_PRES_MASK);
+    TEST_SETTLE(1, PWR_EVT_NONE);
+    test_edge(0);
+    TEST_SETTLE(1, PWR_EVT_NONE);
+    test_edge(USB_PRES_MASK);
+    test_edge(0);
+    TEST_SETTLE(POWER_DEBOUNCE_TICKS, PWR_EVT_NONE);
+    CHECK(input_state == 0);
+
+    //unplugged for good, after bouncing
+    test_edge(USB_PRES_MASK);
+    TEST_SETTLE(1, PWR_EVT_NONE);
+    test_edge(0);
+    test_edge(USB_PRES_MASK | BAT_CHG_MASK);
+    TEST_SETTLE(POWER_DEBOUNCE_TICKS, PWR_EVT_USB_DISCONNECT);
+    CHECK(input_state == (USB_PRES_MASK | BAT_CHG_MASK));
+    TEST_SETTLE(POWER_DEBOUNCE_TICKS, PWR_EVT_NONE);
+}
+
+int main(void)
+{
+    host_reset();
+    power_init();
+
+    //starting on battery
+    input_state = USB_PRES_MASK;
+    TEST_STEP(PWR_EVT_NONE, POWER_FLAG_TICK | POWER_FLAG_INPUT, "wake,disconnect,awake");
+    CHECK(power_get_awake_time() == POWER_HOOKS_AWAKE_MS);
+
+    //awake until the deadline, ticks and updates alike
+    ticks++;
+    TEST_STEP(PWR_EVT_NONE, POWER_FLAG_TICK, "awake");
+    TEST_STEP(PWR_EVT_NONE, POWER_FLAG_UPDATE, "awake");
+    TEST_STEP(PWR_EVT_NONE, POWER_FLAG_INPUT, "");
+    TEST_STEP(PWR_EVT_NONE, 0, "");
+    CHECK(!host_wfi_count);
+
+    //the deadline passes: the last awake tick runs, then Stop until woken
+    ticks += TEST_AWAKE_TICKS;
+    TEST_STEP(PWR_EVT_NONE, POWER_FLAG_TICK, "awake,sleep,wake");
+    test_slept();
+
+    //plugged in after waking, and kept awake past the deadline
+    TEST_STEP(PWR_EVT_USB_CONNECT, POWER_FLAG_INPUT, "connect");
+    ticks += 2 * TEST_AWAKE_TICKS;
+    TEST_STEP(PWR_EVT_NONE, POWER_FLAG_TICK, "awake");
+    TEST_STEP(PWR_EVT_NONE, POWER_FLAG_UPDATE, "awake");
+    TEST_STEP(PWR_EVT_NONE, POWER_FLAG_INPUT, "");
+    CHECK(!host_wfi_count);
+
+    //unplugged, then asleep at the next tick
+    TEST_STEP(PWR_EVT_USB_DISCONNECT, POWER_FLAG_INPUT, "disconnect");
+    ticks++;
+    TEST_STEP(PWR_EVT_NONE, POWER_FLAG_TICK, "awake,sleep,wake");
+    test_slept();
+
+    //unplugged again right after a plug, before the awake time is up
+    TEST_STEP(PWR_EVT_USB_CONNECT, POWER_FLAG_INPUT, "connect");
+    TEST_STEP(PWR_EVT_USB_DISCONNECT, POWER_FLAG_INPUT | POWER_FLAG_TICK, "disconnect,awake,sleep,wake");
+    test_slept();
+
+    //events which don't apply to the state are ignored
+    TEST_STEP(PWR_EVT_USB_DISCONNECT, POWER_FLAG_INPUT, "");
+    TEST_STEP(PWR_EVT_USB_CONNECT, POWER_FLAG_INPUT, "connect");
+    TEST_STEP(PWR_EVT_USB_CONNECT, POWER_FLAG_INPUT, "");
+
+    test_debounce();
+
+    if (host_failures)
+    {
+        printf("test_power: %u failures\n", host_failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * LED Wristwatch
+ *
+ * Kevin Cuzner
+ */
+
+#include "host.h"
+
+#include "../../common/src/power.c"
+
+/**
+ * Checks that the sleep pin table lists every GPIOA and GPIOB pin exactly
+ * once
+ */
+static void test_every_pin_listed(void)
+{
+    for (uint8_t p = 0; p < SLEEP_PORT_COUNT; p++)
+    {
+        uint16_t listed = 0;
+
+        for (uint8_t i = 0; i < SLEEP_PIN_COUNT; i++)
+        {
+            const PowerSleepPin *entry = &sleep_pins[i];
+            if (entry->port != sleep_ports[p])
+                continue;
+
+            if (listed & entry->pins)
+                printf("port %u: pins 0x%04x listed more than once\n", p, listed & entry->pins);
+            CHECK(!(listed & entry->pins));
+            listed |= entry->pins;
+        }
+
+        if (listed != 0xFFFF)
+            printf("port %u: pins 0x%04x not listed\n", p, (uint16_t)~listed);
+        CHECK(listed == 0xFFFF);
+    }
+
+    for (uint8_t i = 0; i < SLEEP_PIN_COUNT; i++)
+    {
+        CHECK(sleep_pins[i].port == GPIOA || sleep_pins[i].port == GPIOB);
+    }
+}
+
+/**
+ * Checks that the pins pass the audit once in their sleep state, and are
+ * restored afterwards
+ */
+static void test_stop_state(void)
+{
+    uint32_t moder_a, moder_b;
+
+    host_reset();
+    power_init();
+    moder_a = host_gpioa.MODER;
+    moder_b = host_gpiob.MODER;
+
+    //every output starts at the opposite of its sleep level
+    host_gpioa.ODR = 0xFFC0;
+    host_gpiob.ODR = 0xFF7F;
+
+    power_enter_stop_state();
+    CHECK(!power_get_sleep_violations());
+
+    //the LED lines and the mux enable high, the buzzer and mux select low
+    CHECK((host_gpioa.ODR & 0x007F) == 0x003F);
+    CHECK((host_gpiob.ODR & 0x00F8) == 0x0080);
+    CHECK((host_gpioa.MODER & 0x3FFF) == 0x1555);
+    CHECK((host_gpiob.MODER & 0xFFC0) == 0x5540);
+
+    power_exit_stop_state();
+    CHECK(host_gpioa.MODER == moder_a);
+    CHECK(host_gpiob.MODER == moder_b);
+    CHECK(host_gpioa.ODR == 0xFFC0);
+    CHECK(host_gpiob.ODR == 0xFF7F);
+}
+
+int main(void)
+{
+    test_every_pin_listed();
+    test_stop_state();
+
+    if (host_failures)
+    {
+        printf("test_sleep_pins: %u failures\n", host_failures);
+        return 1;
+    }
+    return 0;
+}
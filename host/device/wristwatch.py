@@ -3,7 +3,7 @@ Basic methods and classes for interfacing with the wristwatch
 """
 
 import hid
-import struct, time
+import datetime, struct, time
 
 VID = 0x16c0
 PID = 0x05dc
@@ -22,7 +22,7 @@ class Command(object):
 class SetTimeCommand(Command):
     COMMAND = 1
     def __init__(self, timestamp):
-        parts = bytes([int(s) for s in time.strftime('%y,%m,%d,%H,%M,%S', timestamp).split(',')])
+        parts = bytes([int(s) for s in time.strftime('%y,%m,%d,%H,%M,%S,%u', timestamp).split(',')])
         super().__init__(SetTimeCommand.COMMAND, parts)
 
 class EnterBootloaderCommand(Command):
@@ -30,6 +30,164 @@ class EnterBootloaderCommand(Command):
     def __init__(self):
         super().__init__(EnterBootloaderCommand.COMMAND, b'')
 
+class GetResidencyCommand(Command):
+    COMMAND = 3
+    def __init__(self):
+        super().__init__(GetResidencyCommand.COMMAND, b'')
+
+class SyncTimeCommand(Command):
+    """
+    Two phase time sync. A probe only reads the watch time, an apply brings
+    the watch to the time sent (with millisecond precision) and reports the
+    offset it applied. The weekday is sent along since the watch doesn't
+    compute it.
+    """
+    COMMAND = 4
+    PROBE = 0
+    APPLY = 1
+    FORMAT = '<7BHIiB'
+    def __init__(self, phase, echo, timestamp=None):
+        if timestamp is None:
+            fields = (0,) * 7
+            weekday = 0
+        else:
+            t = datetime.datetime.fromtimestamp(timestamp)
+            fields = (t.year % 100, t.month, t.day, t.hour, t.minute, t.second,
+                    t.microsecond // 1000)
+            weekday = t.isoweekday()
+        data = struct.pack(SyncTimeCommand.FORMAT, phase, *fields, echo, 0, weekday)
+        super().__init__(SyncTimeCommand.COMMAND, data)
+
+class TimeSyncError(Exception):
+    """
+    A time sync answer was received but holds an invalid time
+    """
+    pass
+
+class TimeSync(object):
+    """
+    Answer to a SyncTimeCommand: the watch time read after handling it
+    """
+    def __init__(self, data):
+        size = struct.calcsize(SyncTimeCommand.FORMAT)
+        command, = struct.unpack('<I', bytes(data[:4]))
+        if command != SyncTimeCommand.COMMAND:
+            raise ValueError('Not a time sync answer')
+        (self.phase, year, month, day, hour, minute, second, ms, self.echo,
+                self.offset, self.weekday) = struct.unpack(SyncTimeCommand.FORMAT, bytes(data[4:4 + size]))
+        #not a ValueError, so sync_command doesn't skip it as another report
+        if ms > 999:
+            raise TimeSyncError('Time sync answer has {} ms'.format(ms))
+        try:
+            self.timestamp = datetime.datetime(2000 + year, month, day, hour, minute,
+                    second, ms * 1000).timestamp()
+        except ValueError as e:
+            raise TimeSyncError('Time sync answer has an invalid time: {}'.format(e))
+
+class GetBootTimelineCommand(Command):
+    COMMAND = 5
+    def __init__(self):
+        super().__init__(GetBootTimelineCommand.COMMAND, b'')
+
+class BootTimeline(object):
+    """
+    Time each boot milestone was reached after reset in microseconds, or None
+    if it wasn't reached yet, and the RTC clock source
+    """
+    STAGES = ['init', 'first_frame', 'rtc_clock']
+    RTC_CLOCKS = ['starting', 'LSE', 'LSI']
+    def __init__(self, data):
+        unpacked = struct.unpack('<I3IB47s', bytes(data))
+        for name, value in zip(BootTimeline.STAGES, unpacked[1:4]):
+            setattr(self, name, value if value else None)
+        self.rtc_source = BootTimeline.RTC_CLOCKS[unpacked[4]]
+
+class Alarm(object):
+    """
+    Alarm table entry. Weekdays are numbered from Monday = 0, as in datetime.
+    """
+    BUZZER = 0x1
+    DISPLAY = 0x2
+    def __init__(self, hours, minutes, weekdays=range(7), actions=BUZZER | DISPLAY):
+        self.hours = hours
+        self.minutes = minutes
+        self.weekdays = set(weekdays)
+        self.actions = actions
+
+    def pack(self):
+        mask = sum(1 << d for d in self.weekdays)
+        return struct.pack('<4B', self.hours, self.minutes, mask, self.actions)
+
+class Chime(object):
+    """
+    Hourly chime at a minute of every hour, except from quiet_start up to
+    quiet_end. A chime without actions is off.
+    """
+    def __init__(self, minute=0, actions=0, quiet_start=0, quiet_end=0):
+        self.minute = minute
+        self.actions = actions
+        self.quiet_start = quiet_start
+        self.quiet_end = quiet_end
+
+    def pack(self):
+        return struct.pack('<4B', self.minute, self.actions, self.quiet_start, self.quiet_end)
+
+class GetAlarmsCommand(Command):
+    COMMAND = 6
+    def __init__(self):
+        super().__init__(GetAlarmsCommand.COMMAND, b'')
+
+class SetAlarmsCommand(Command):
+    """
+    Replaces the alarms and the chime. The watch stores them sorted by time
+    and answers with them like GetAlarmsCommand.
+    """
+    COMMAND = 7
+    def __init__(self, alarms, chime):
+        if len(alarms) > AlarmsConfig.COUNT:
+            raise ValueError('At most {} alarms are supported'.format(AlarmsConfig.COUNT))
+        unused = b'\x00' * 4 * (AlarmsConfig.COUNT - len(alarms))
+        data = b''.join(a.pack() for a in alarms) + unused + chime.pack()
+        super().__init__(SetAlarmsCommand.COMMAND, data)
+
+class AlarmsConfig(object):
+    """
+    Alarms and chime stored in the watch
+    """
+    COUNT = 8
+    def __init__(self, data):
+        command, = struct.unpack('<I', bytes(data[:4]))
+        if command != GetAlarmsCommand.COMMAND:
+            raise ValueError('Not an alarms answer')
+        self.alarms = []
+        for i in range(AlarmsConfig.COUNT):
+            hours, minutes, mask, actions = struct.unpack_from('<4B', bytes(data), 4 + 4 * i)
+            if mask:
+                self.alarms.append(Alarm(hours, minutes,
+                    [d for d in range(7) if mask & (1 << d)], actions))
+        self.chime = Chime(*struct.unpack_from('<4B', bytes(data), 4 + 4 * AlarmsConfig.COUNT))
+
+class Residency(object):
+    """
+    Time spent in each power state since reset, in seconds, the
+    latency of the last wake in microseconds, the core cycles of the last
+    animation render and the pins not in their sleep state when last going
+    to sleep
+    """
+    FIELDS = ['run_msi', 'run_hsi16', 'run_lprun', 'sleep', 'stop', 'display',
+            'buzzer', 'lit_leds', 'wake_latency', 'render_cycles',
+            'sleep_violations']
+    def __init__(self, data):
+        unpacked = struct.unpack('<I10IB19s', bytes(data))
+        for name, value in zip(Residency.FIELDS, unpacked[1:]):
+            setattr(self, name, value)
+
+    def total(self):
+        """
+        Total time accounted to the power states, in seconds
+        """
+        return self.run_msi + self.run_hsi16 + self.run_lprun + self.sleep + self.stop
+
 class Device(hid.device):
     MANUFACTURER='kevincuzner.com'
     PRODUCT='LED Wristwatch'
@@ -50,10 +208,105 @@ class Device(hid.device):
         cmd = SetTimeCommand(time.localtime())
         self.write_command(cmd)
 
+    def probe_time(self, echo):
+        """
+        Reads the watch time
+
+        Returns the answer, the round trip time in seconds and the offset of
+        the watch from the host in seconds, assuming the watch read its time
+        halfway through the round trip
+        """
+        sent = time.time()
+        answer = self.sync_command(SyncTimeCommand(SyncTimeCommand.PROBE, echo))
+        received = time.time()
+        return answer, received - sent, answer.timestamp - (sent + received) / 2
+
+    def sync_time(self, probes=8):
+        """
+        Sets the watch time to the current time with millisecond precision
+
+        The round trip is measured with a few probes. The time sent is then
+        advanced by half of the fastest one so that it is correct when the
+        watch applies it.
+
+        Returns the offset the watch applied in milliseconds (None if it had
+        to set the date), the round trip time and the remaining offset of the
+        watch from the host, both in seconds
+        """
+        rtt = min(self.probe_time(i)[1] for i in range(probes))
+        cmd = SyncTimeCommand(SyncTimeCommand.APPLY, probes, time.time() + rtt / 2)
+        applied = self.sync_command(cmd).offset
+        if applied == -2**31:
+            applied = None
+        _, rtt, offset = min((self.probe_time(probes + 1 + i) for i in range(probes)),
+                key=lambda p: p[1])
+        return applied, rtt, offset
+
+    def sync_command(self, cmd):
+        """
+        Sends a SyncTimeCommand and waits for its answer
+
+        Other reports are skipped. An answer with an invalid time raises
+        TimeSyncError.
+        """
+        echo = struct.unpack_from(SyncTimeCommand.FORMAT, cmd.data_bytes)[8]
+        self.write_command(cmd)
+        while True:
+            result = self.read(64, timeout_ms=1000)
+            if len(result) != 64:
+                raise ValueError('No time sync answer received')
+            try:
+                answer = TimeSync(result)
+            except ValueError:
+                continue
+            if answer.echo == echo:
+                return answer
+
     def enter_bootloader(self):
         cmd = EnterBootloaderCommand()
         self.write_command(cmd)
 
+    def get_residency(self):
+        """
+        Reads the power state residency counters
+        """
+        self.write_command(GetResidencyCommand())
+        result = self.read(64, timeout_ms=1000)
+        if len(result) != 64:
+            raise ValueError('No residency report received')
+        return Residency(result)
+
+    def get_boot_timeline(self):
+        """
+        Reads the boot timeline
+        """
+        self.write_command(GetBootTimelineCommand())
+        result = self.read(64, timeout_ms=1000)
+        if len(result) != 64:
+            raise ValueError('No boot timeline received')
+        return BootTimeline(result)
+
+    def get_alarms(self):
+        """
+        Reads the alarms and the chime
+        """
+        return self.alarms_command(GetAlarmsCommand())
+
+    def set_alarms(self, alarms, chime):
+        """
+        Replaces the alarms and the chime
+
+        Returns them as stored by the watch
+        """
+        return self.alarms_command(SetAlarmsCommand(alarms, chime))
+
+    def alarms_command(self, cmd):
+        self.write_command(cmd)
+        result = self.read(64, timeout_ms=1000)
+        if len(result) != 64:
+            raise ValueError('No alarms received')
+        return AlarmsConfig(result)
+
     def write_command(self, command):
         data = b'\x00' + command.pack() #prepend a zero since we don't use REPORT_ID
         res = self.write(data)